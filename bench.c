@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <omp.h>
+
+#include <bnc.h>
+
+#define SMALL_FILES 2048
+
+/**
+ * Alternating bytes of this length code to exactly one page, which lands the end of a volume on a page boundary
+ */
+#define ALIGNED_MEMBER 32749
+
+typedef struct Corpus Corpus;
+
+struct Corpus
+{
+  const char* name;
+  Byte*       bytes;
+  Count       size;
+  Count       files;
+};
+
+static FILE* output;
+
+/**
+ * Deterministic xorshift so that every run measures the same corpora
+ */
+static Count random_state = 88172645463325252UL;
+
+static Count random_next (void)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+
+  return random_state;
+}
+
+static double now (void)
+{
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void report (const char* corpus, const char* stage, int threads, Count size, Count compressed_size, double seconds)
+{
+  double rate = seconds > 0 ? size / seconds / 1e6 : 0;
+
+  fprintf(output, "{\"corpus\":\"%s\",\"stage\":\"%s\",\"threads\":%d,\"bytes\":%zu,\"compressed\":%zu,\"seconds\":%.6f,\"mbps\":%.2f}\n",
+          corpus, stage, threads, size, compressed_size, seconds, rate);
+
+  fprintf(stderr, "%-8s %-11s %3d threads %10.2f MB/s %10.6f s\n", corpus, stage, threads, rate, seconds);
+}
+
+static void generate_uniform (Byte* bytes, Count size)
+{
+  Count i;
+
+  for (i = 0; i < size; ++i) bytes[i] = random_next();
+}
+
+static void generate_skewed (Byte* bytes, Count size)
+{
+  Count i;
+
+  /**
+   * Geometric distribution, every value is half as likely as the previous one
+   */
+  for (i = 0; i < size; ++i) bytes[i] = __builtin_ctzll(random_next() | ((Count)1 << 63));
+}
+
+static void generate_text (Byte* bytes, Count size)
+{
+  const char* words[] =
+  {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on", "not",
+    "archive", "member", "stream", "tree", "window", "buffer", "code", "value", "count", "offset", "size",
+    "huffman", "decode", "encode", "table", "block", "file", "index", "name", "thread", "memory", "page"
+  };
+
+  Count i = 0;
+  Count column = 0;
+
+  while (i < size)
+  {
+    const char* word = words[random_next() % (sizeof(words) / sizeof(*words))];
+
+    while (*word && i < size) bytes[i++] = *word++;
+
+    if (i < size) bytes[i++] = ++column % 12 ? ' ' : '\n';
+  }
+}
+
+static void generate_zeros (Byte* bytes, Count size)
+{
+  Count i;
+
+  memset(bytes, 0, size);
+
+  for (i = 0; i < size; ++i)
+  {
+    if (random_next() % 32 == 0) bytes[i] = random_next();
+  }
+}
+
+static Tree* bench_histogram (Corpus* corpus, int threads)
+{
+  Count i;
+  double start = now();
+  Tree* tree   = tree_new();
+
+  tree_empty(tree);
+
+  for (i = 0; i < corpus->size; ++i)
+  {
+    tree_register(tree, corpus->bytes[i]);
+  }
+
+  report(corpus->name, "histogram", threads, corpus->size, 0, now() - start);
+
+  return tree;
+}
+
+static void bench_stages (Corpus* corpus, Count window, int threads)
+{
+  Count compressed_size;
+  double start;
+  Tree* tree = bench_histogram(corpus, threads);
+  Tree* decoder;
+  Value* decoded;
+  BitStream* stream;
+  char path[] = "/tmp/bnc-bench-XXXXXX";
+  int backend = mkstemp(path);
+
+  start = now();
+  tree_build(tree);
+  report(corpus->name, "tree_build", threads, corpus->size, 0, now() - start);
+
+  compressed_size = (tree->bit_count + tree->table[0]->bit_count + 7) / 8;
+
+  ftruncate(backend, window * ((compressed_size + 2 * sizeof(Count) + window - 1) / window));
+
+  start  = now();
+  stream = bit_stream_new(backend, PROT_READ | PROT_WRITE, 0, window);
+
+  tree_set_write_stream(tree, stream);
+  tree_build_pair_table(tree);
+  tree_write_many(tree, corpus->bytes, corpus->size);
+
+  bit_stream_delete(stream);
+  tree->stream = NULL;
+
+  report(corpus->name, "encode", threads, corpus->size, compressed_size, now() - start);
+
+  start   = now();
+  decoder = tree_new();
+  stream  = bit_stream_new(backend, PROT_READ, 0, window);
+  decoded = (Value*)malloc(corpus->size);
+
+  tree_set_read_stream(decoder, stream);
+  tree_read_many(decoder, decoded, corpus->size);
+
+  report(corpus->name, "decode", threads, corpus->size, compressed_size, now() - start);
+
+  if (memcmp(decoded, corpus->bytes, corpus->size) != 0)
+  {
+    fprintf(stderr, "%s: decoded bytes differ\n", corpus->name);
+  }
+
+  free(decoded);
+
+  tree_delete(decoder);
+  tree_delete(tree);
+
+  close(backend);
+  unlink(path);
+}
+
+/**
+ * Runs the whole archive round trip inside a scratch directory, silencing the per member output
+ */
+static void bench_archive (Corpus* corpus, int threads)
+{
+  Count i;
+  Count offset = 0;
+  Count compressed_size;
+  char directory[] = "/tmp/bnc-bench-XXXXXX";
+  char name[32];
+  double start;
+  int working         = open(".", O_RDONLY | O_DIRECTORY);
+  int standard_output = dup(STDOUT_FILENO);
+  int null            = open("/dev/null", O_WRONLY);
+  Budget* budget      = budget_new(0);
+  Archive* archive;
+  FILE* file;
+
+  mkdtemp(directory);
+  chdir(directory);
+  mkdir("out", S_IRWXU);
+
+  archive = archive_new("archive", budget);
+
+  for (i = 0; i < corpus->files; ++i)
+  {
+    Count size = i + 1 < corpus->files ? corpus->size / corpus->files : corpus->size - offset;
+
+    snprintf(name, sizeof(name), "member%zu", i);
+
+    file = fopen(name, "wb");
+    fwrite(corpus->bytes + offset, 1, size, file);
+    fclose(file);
+
+    archive_add_file(archive, name);
+
+    offset += size;
+  }
+
+  omp_set_num_threads(threads);
+
+  fflush(stdout);
+  dup2(null, STDOUT_FILENO);
+
+  start = now();
+  archive_compress(archive);
+  fflush(stdout);
+  dup2(standard_output, STDOUT_FILENO);
+
+  file = fopen("archive", "rb");
+  fseek(file, 0, SEEK_END);
+  compressed_size = ftell(file);
+  fclose(file);
+
+  report(corpus->name, "compress", threads, corpus->size, compressed_size, now() - start);
+
+  archive_delete(archive);
+
+  chdir("out");
+
+  archive = archive_new("../archive", budget);
+
+  dup2(null, STDOUT_FILENO);
+
+  start = now();
+  archive_decompress(archive);
+  fflush(stdout);
+  dup2(standard_output, STDOUT_FILENO);
+
+  report(corpus->name, "decompress", threads, corpus->size, compressed_size, now() - start);
+
+  archive_delete(archive);
+
+  for (i = 0; i < corpus->files; ++i)
+  {
+    snprintf(name, sizeof(name), "member%zu", i);
+
+    unlink(name);
+
+    snprintf(name, sizeof(name), "../member%zu", i);
+
+    unlink(name);
+  }
+
+  chdir("..");
+  rmdir("out");
+  unlink("archive");
+  fchdir(working);
+  rmdir(directory);
+
+  budget_delete(budget);
+  close(null);
+  close(standard_output);
+  close(working);
+}
+
+/**
+ * Round trip of a member whose volume ends exactly on a page, decoding must not touch the page after it
+ */
+static int bench_volumes (void)
+{
+  Count i;
+  Count size;
+  Byte* bytes;
+  Byte* decoded;
+  char directory[] = "/tmp/bnc-bench-XXXXXX";
+  int working         = open(".", O_RDONLY | O_DIRECTORY);
+  int standard_output = dup(STDOUT_FILENO);
+  int null            = open("/dev/null", O_WRONLY);
+  int status          = -1;
+  Budget* budget      = budget_new(0);
+  Archive* archive;
+  FILE* file;
+  struct stat volume;
+
+  bytes   = (Byte*)malloc(ALIGNED_MEMBER);
+  decoded = (Byte*)malloc(ALIGNED_MEMBER);
+
+  for (i = 0; i < ALIGNED_MEMBER; ++i) bytes[i] = i % 2 ? 'b' : 'a';
+
+  mkdtemp(directory);
+  chdir(directory);
+  mkdir("out", S_IRWXU);
+
+  file = fopen("member", "wb");
+  fwrite(bytes, 1, ALIGNED_MEMBER, file);
+  fclose(file);
+
+  fflush(stdout);
+  dup2(null, STDOUT_FILENO);
+
+  archive = archive_new("archive", budget);
+  archive->volume_limit = 1024;
+
+  archive_add_file(archive, "member");
+  archive_compress(archive);
+  archive_delete(archive);
+
+  chdir("out");
+
+  archive = archive_new("../archive", budget);
+
+  archive_decompress(archive);
+  archive_delete(archive);
+
+  fflush(stdout);
+  dup2(standard_output, STDOUT_FILENO);
+
+  file = fopen("member", "rb");
+  size = file ? fread(decoded, 1, ALIGNED_MEMBER, file) : 0;
+
+  if (file) fclose(file);
+
+  if (size == ALIGNED_MEMBER && memcmp(decoded, bytes, size) == 0) status = 0;
+
+  if (stat("../archive.1", &volume) == 0 && volume.st_size % sysconf(_SC_PAGESIZE) != 0)
+  {
+    fprintf(stderr, "volumes: the volume no longer ends on a page\n");
+  }
+
+  fprintf(stderr, "volumes: page aligned round trip %s\n", status == 0 ? "ok" : "differs");
+
+  unlink("member");
+  chdir("..");
+  rmdir("out");
+  unlink("member");
+  unlink("archive");
+  unlink("archive.1");
+  fchdir(working);
+  rmdir(directory);
+
+  free(bytes);
+  free(decoded);
+
+  budget_delete(budget);
+  close(null);
+  close(standard_output);
+  close(working);
+
+  return status;
+}
+
+const char* help = "./bnc-bench [-s size] [-o output]";
+
+int main (int argc, char** argv)
+{
+  Corpus corpora[] =
+  {
+    { "uniform", NULL, 0, 1           },
+    { "skewed",  NULL, 0, 1           },
+    { "text",    NULL, 0, 1           },
+    { "zeros",   NULL, 0, 1           },
+    { "small",   NULL, 0, SMALL_FILES }
+  };
+
+  void (*generators[])(Byte*, Count) =
+  {
+    generate_uniform, generate_skewed, generate_text, generate_zeros, generate_text
+  };
+
+  Count i;
+  Count size = (Count)16 << 20;
+  int threads;
+  int option;
+  int processors = omp_get_num_procs();
+  Budget* budget = budget_new(0);
+
+  output = stdout;
+
+  while ((option = getopt(argc, argv, "s:o:")) != -1)
+  {
+    switch (option)
+    {
+      case 's': size   = strtoull(optarg, NULL, 10) << 20; break;
+      case 'o': output = fopen(optarg, "w");               break;
+      default:
+        printf("%s\n", help);
+
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (output == NULL)
+  {
+    perror("bnc-bench");
+
+    return EXIT_FAILURE;
+  }
+
+  budget_plan(budget, 1, 0);
+
+  if (bench_volumes() != 0)
+  {
+    budget_delete(budget);
+
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < sizeof(corpora) / sizeof(*corpora); ++i)
+  {
+    Corpus* corpus = &corpora[i];
+
+    corpus->size  = size;
+    corpus->bytes = (Byte*)malloc(size);
+
+    generators[i](corpus->bytes, corpus->size);
+
+    bench_stages(corpus, budget->window, 1);
+
+    /**
+     * End to end across thread counts, doubling up to the number of processors
+     */
+    for (threads = 1; ; threads = threads * 2 < processors ? threads * 2 : processors)
+    {
+      bench_archive(corpus, threads);
+
+      if (threads >= processors) break;
+    }
+
+    free(corpus->bytes);
+  }
+
+  budget_delete(budget);
+
+  if (output != stdout) fclose(output);
+
+  return EXIT_SUCCESS;
+}
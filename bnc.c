@@ -1,15 +1,125 @@
+#define _GNU_SOURCE
+
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <endian.h>
 #include <arpa/inet.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+
+#include <linux/fs.h>
+
+#include <omp.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <bnc.h>
 
-#define MAP_SIZE ((Count)4096 * sysconf(_SC_PAGESIZE))
+#define PAGE_SIZE      ((Count)sysconf(_SC_PAGESIZE))
+#define DEFAULT_WINDOW ((Count)4096 * PAGE_SIZE)
+
+/**
+ * Rough footprint of a Tree with all of its leaves, translations, the serialised tree and the pair table
+ */
+#define TREE_COST (sizeof(Tree) + WORDS * (2 * sizeof(InnerNode) + sizeof(BitVector) + 8) + WORDS * WORDS * sizeof(Count))
+
+#define STREAM_COST(budget) ((budget)->window + 2 * (budget)->buffer + TREE_COST)
+
+/**
+ * Scanning maps no window
+ */
+#define SCAN_COST(budget) (2 * (budget)->buffer + TREE_COST)
+
+/**
+ * Filtered members are coded through a frame and its scratch, trying the filters takes a third frame
+ */
+#define FILTER_COST(filter) ((filter) == FILTER_NONE ? 0 : ((filter) == FILTER_AUTO ? 3 : 2) * FILTER_FRAME)
+
+/**
+ * Every stream in flight needs at least one page of window, small stdio buffers and its tree
+ */
+#define STREAM_MINIMUM (PAGE_SIZE + 2 * PAGE_SIZE / 8 + TREE_COST)
+
+/**
+ * A member kept from scanning to writing holds its File and its tree without the pair table, with runs of
+ * blocks also a histogram and an extent per block
+ */
+#define KEPT_COST  (sizeof(File) + TREE_COST - WORDS * WORDS * sizeof(Count))
+#define BLOCK_COST ((WORDS + 2) * sizeof(Count))
+
+/**
+ * Streams waiting for room in the budget look again after this many microseconds
+ */
+#define BUDGET_WAIT 100
+
+/**
+ * FNV-1a, used both for member fingerprints and for the name hash table
+ */
+#define HASH_BASIS 14695981039346656037UL
+#define HASH_PRIME 1099511628211UL
+
+#define COPY_SIZE ((Count)1 << 16)
+
+/**
+ * Sampled histograms read one chunk out of every `sample` chunks
+ */
+#define SAMPLE_CHUNK ((Count)1 << 16)
+
+/**
+ * Members of the same size are told apart by a hash of FINGERPRINT_SLICES chunks spread over them
+ */
+#define FINGERPRINT_SLICES 4
+
+/**
+ * Sampled members are given room for their estimated size and one part in SAMPLE_MARGIN more
+ */
+#define SAMPLE_MARGIN 16
+
+/**
+ * Zeros are scanned for in blocks, runs of at least ZERO_RUN bytes are not encoded but restored as holes
+ */
+#define ZERO_BLOCK ((Count)1 << 12)
+#define ZERO_RUN   ((Count)1 << 16)
+
+/**
+ * Directory entries are read in batches of this many bytes
+ */
+#define WALK_BUFFER ((Count)1 << 15)
+
+/**
+ * Filters are tried on the first frame of members with at least FILTER_TRIAL bytes of data, and must beat
+ * no filter by 1 / FILTER_MARGIN of its estimated cost
+ */
+#define FILTER_TRIAL  ((Count)1 << 12)
+#define FILTER_MARGIN 32
+
+/**
+ * The planner reads PLAN_SLICES slices spread over the data, PLAN_SAMPLE bytes in all, and tries blocks of
+ * PLAN_BLOCK bytes unless a block size is given
+ */
+#define PLAN_SAMPLE ((Count)1 << 20)
+#define PLAN_SLICES 4
+#define PLAN_BLOCK  ((Count)1 << 16)
+
+/**
+ * The sample, its copy and scratch, the coded trial and the tree that codes it
+ */
+#define PLAN_COST (4 * PLAN_SAMPLE + CODER_HEADER + TREE_COST)
 
 #define CUT_LOWER(n, m)     ((n) &   ((1 << (m)) - 1))
 #define CUT_OFF_LOWER(n, m) ((n) & (~((1 << (m)) - 1)))
@@ -54,6 +164,306 @@ static char* pretty_print_size (Count size)
   return buffer;
 }
 
+Budget* budget_new (const Count limit)
+{
+  Budget* budget = (Budget*)malloc(sizeof(Budget));
+
+  budget->limit   = limit;
+  budget->window  = DEFAULT_WINDOW;
+  budget->buffer  = BUFSIZ;
+  budget->streams = omp_get_max_threads();
+
+  budget->in_flight      = 0;
+  budget->peak_in_flight = 0;
+  budget->kept           = 0;
+  budget->streamed       = 0;
+  budget->usage          = 0;
+  budget->peak_usage     = 0;
+
+  /**
+   * A single stream still runs, over the limit
+   */
+  if (limit > 0 && limit < STREAM_MINIMUM)
+  {
+    char* requested = pretty_print_size(limit);
+    char* minimum   = pretty_print_size(STREAM_MINIMUM);
+
+    fprintf(stderr, "Budget %s is below the %s of a single stream, which will exceed it\n", requested, minimum);
+
+    free(requested);
+    free(minimum);
+  }
+
+  return budget;
+}
+
+/**
+ * Streams are planned within what the members kept between their passes leave of the limit, each also
+ * needing `extra` bytes next to its window, buffers and tree
+ */
+void budget_plan (Budget* budget, const Count members, const Count extra)
+{
+  Count share;
+  Count minimum;
+  Count limit = budget->limit - budget->kept;
+
+  budget->window  = DEFAULT_WINDOW;
+  budget->buffer  = BUFSIZ;
+  budget->streams = omp_get_max_threads();
+
+  if (members > 0 && members < budget->streams)
+  {
+    budget->streams = members;
+  }
+
+  if (budget->limit == 0)
+  {
+    return;
+  }
+
+  minimum = STREAM_MINIMUM + extra;
+
+  if (budget->streams * minimum > limit)
+  {
+    budget->streams = limit / minimum > 0 ? limit / minimum : 1;
+  }
+
+  share = limit / budget->streams;
+  share = share > extra ? share - extra : 0;
+
+  if (budget->buffer > share / 8)
+  {
+    budget->buffer = share / 8 > PAGE_SIZE / 8 ? share / 8 : PAGE_SIZE / 8;
+  }
+
+  /**
+   * Whatever is left is the mapped window, rounded down to whole pages
+   */
+  budget->window = share > 2 * budget->buffer + TREE_COST ? share - 2 * budget->buffer - TREE_COST : 0;
+  budget->window = PAGE_SIZE * (budget->window / PAGE_SIZE);
+
+  if (budget->window < PAGE_SIZE)      budget->window = PAGE_SIZE;
+  if (budget->window > DEFAULT_WINDOW) budget->window = DEFAULT_WINDOW;
+}
+
+/**
+ * Waits until the stream fits next to everything already charged. The first stream in flight always
+ * goes, over the limit if it has to
+ */
+void budget_acquire (Budget* budget, const Count cost)
+{
+  int granted = 0;
+
+  while (1)
+  {
+    #pragma omp critical (budget)
+    {
+      if (budget->limit == 0 || budget->in_flight == 0 || budget->usage + cost <= budget->limit)
+      {
+        ++budget->in_flight;
+        budget->usage += cost;
+
+        if (budget->in_flight > budget->peak_in_flight) budget->peak_in_flight = budget->in_flight;
+        if (budget->usage     > budget->peak_usage)     budget->peak_usage     = budget->usage;
+
+        granted = 1;
+      }
+    }
+
+    if (granted) return;
+
+    /**
+     * Tasks of the streams in flight can run here meanwhile
+     */
+    #pragma omp taskyield
+
+    usleep(BUDGET_WAIT);
+  }
+}
+
+void budget_release (Budget* budget, const Count cost)
+{
+  #pragma omp critical (budget)
+  {
+    --budget->in_flight;
+    budget->usage -= cost;
+  }
+}
+
+/**
+ * State kept between passes may take up to half of the limit, the streams are planned within the rest.
+ * Past that nothing is charged and the caller streams instead
+ */
+int budget_keep (Budget* budget, const Count size)
+{
+  int kept = 0;
+
+  #pragma omp critical (budget)
+  {
+    if (budget->limit == 0 || budget->kept + size <= budget->limit / 2)
+    {
+      budget->kept  += size;
+      budget->usage += size;
+
+      if (budget->usage > budget->peak_usage) budget->peak_usage = budget->usage;
+
+      kept = 1;
+    }
+    else
+    {
+      ++budget->streamed;
+    }
+  }
+
+  return kept ? 0 : -1;
+}
+
+void budget_drop (Budget* budget, const Count size)
+{
+  #pragma omp critical (budget)
+  {
+    budget->kept  -= size;
+    budget->usage -= size;
+  }
+}
+
+void budget_report (Budget* budget)
+{
+  struct rusage usage;
+  char* limit;
+  char* window;
+  char* buffer;
+  char* peak_usage;
+  char* peak_resident;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  limit         = pretty_print_size(budget->limit);
+  window        = pretty_print_size(budget->window);
+  buffer        = pretty_print_size(budget->buffer);
+  peak_usage    = pretty_print_size(budget->peak_usage);
+  peak_resident = pretty_print_size((Count)usage.ru_maxrss * 1024);
+
+  fprintf(stderr, "Budget %s: %zu streams, %s windows, %s buffers\n", limit, budget->streams, window, buffer);
+  fprintf(stderr, "Peak %zu streams in flight, %s budgeted, %s resident, %zu members streamed\n",
+          budget->peak_in_flight, peak_usage, peak_resident, budget->streamed);
+
+  free(limit);
+  free(window);
+  free(buffer);
+  free(peak_usage);
+  free(peak_resident);
+}
+
+void budget_delete (Budget* budget)
+{
+  free(budget);
+}
+
+double stats_clock (void)
+{
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+Stats* stats_new (void)
+{
+  return (Stats*)calloc(1, sizeof(Stats));
+}
+
+/**
+ * Probes are taken once per member and stage, never per symbol, and a NULL Stats disables them
+ */
+void stats_start (Stats* stats, Probe* probe)
+{
+#ifndef BNC_NO_STATS
+  struct rusage usage;
+
+  if (stats == NULL) return;
+
+  getrusage(RUSAGE_THREAD, &usage);
+
+  probe->start        = stats_clock();
+  probe->minor_faults = usage.ru_minflt;
+  probe->major_faults = usage.ru_majflt;
+#else
+  (void)stats;
+  (void)probe;
+#endif
+}
+
+void stats_stop (Stats* stats, Probe* probe, const Stage stage, const Count bytes)
+{
+#ifndef BNC_NO_STATS
+  struct rusage usage;
+
+  if (stats == NULL) return;
+
+  getrusage(RUSAGE_THREAD, &usage);
+
+  stats->seconds[stage] += stats_clock() - probe->start;
+  stats->bytes[stage]   += bytes;
+  stats->minor_faults   += usage.ru_minflt - probe->minor_faults;
+  stats->major_faults   += usage.ru_majflt - probe->major_faults;
+#else
+  (void)stats;
+  (void)probe;
+  (void)stage;
+  (void)bytes;
+#endif
+}
+
+void stats_merge (Stats* total, Stats* stats)
+{
+  Count i;
+
+  #pragma omp critical (stats)
+  {
+    for (i = 0; i < STAGE_COUNT; ++i)
+    {
+      total->seconds[i] += stats->seconds[i];
+      total->bytes[i]   += stats->bytes[i];
+    }
+
+    total->bits         += stats->bits;
+    total->remaps       += stats->remaps;
+    total->minor_faults += stats->minor_faults;
+    total->major_faults += stats->major_faults;
+  }
+}
+
+void stats_delete (Stats* stats)
+{
+  free(stats);
+}
+
+Profile* profile_new (const StatsFormat format)
+{
+  Profile* profile = (Profile*)calloc(1, sizeof(Profile));
+
+  profile->format  = format;
+  profile->threads = omp_get_max_threads();
+  profile->busy    = (double*)calloc(profile->threads, sizeof(double));
+
+  return profile;
+}
+
+void profile_account (Profile* profile, const double seconds)
+{
+  Count thread = omp_get_thread_num();
+
+  if (profile && thread < profile->threads) profile->busy[thread] += seconds;
+}
+
+void profile_delete (Profile* profile)
+{
+  free(profile->busy);
+  free(profile);
+}
+
 Count node_get_count (Node* node)
 {
   return node->count;
@@ -202,6 +612,19 @@ void bit_vector_set_context (BitVector* vector, Byte left, Byte right)
   vector->bytes[vector->count / 8 + 2]  = right >> (8 - (vector->count % 8));
 }
 
+static void bit_vector_assign (BitVector* vector, BitVector* source)
+{
+  if (vector->size < source->size)
+  {
+    vector->size  = source->size;
+    vector->bytes = (Byte*)realloc(vector->bytes, (vector->size + 2) * sizeof(Byte));
+  }
+
+  vector->count = source->count;
+
+  memcpy(vector->bytes + 1, source->bytes + 1, (vector->count + 7) / 8);
+}
+
 void bit_vector_delete (BitVector* vector)
 {
   free(vector->bytes);
@@ -210,59 +633,187 @@ void bit_vector_delete (BitVector* vector)
 
 static void bit_stream_load_block (BitStream* stream)
 {
-  stream->memory_block = mmap(NULL, MAP_SIZE, stream->protocol, MAP_SHARED, stream->backend, MAP_SIZE * (stream->offset / MAP_SIZE));
-  stream->count        = (stream->count % 8) + (stream->offset % MAP_SIZE) * 8;
+  struct stat status;
+  Count base = stream->window * (stream->offset / stream->window);
+
+  /**
+   * Memory backed streams have a single window, running past it means the input is corrupt. So does a
+   * window that starts past the end of the backend
+   */
+  if (stream->backend < 0 || fstat(stream->backend, &status) != 0 || (Count)status.st_size <= base)
+  {
+    stream->memory_block = NULL;
+    stream->failed       = 1;
+    stream->count        = 0;
+    stream->end          = 0;
+
+    return;
+  }
+
+  stream->memory_block = mmap(NULL, stream->window, stream->protocol, MAP_SHARED, stream->backend, base);
+  stream->count        = (stream->count % 8) + (stream->offset % stream->window) * 8;
+  stream->end          = status.st_size - base < stream->window ? status.st_size - base : stream->window;
+
+  if (stream->memory_block == MAP_FAILED)
+  {
+    stream->memory_block = NULL;
+    stream->failed       = 1;
+    stream->count        = 0;
+    stream->end          = 0;
+
+    return;
+  }
+
+  ++stream->remaps;
 }
 
 static void bit_stream_flush_block (BitStream* stream)
 {
-  munmap(stream->memory_block, MAP_SIZE);
-  stream->offset = MAP_SIZE * (stream->offset / MAP_SIZE + 1);
+  if (stream->backend < 0) return;
+
+  if (stream->memory_block) munmap(stream->memory_block, stream->window);
+
+  stream->memory_block = NULL;
+  stream->offset       = stream->window * (stream->offset / stream->window + 1);
+}
+
+/**
+ * Moves on to the next window when the current one is used up, fails the stream at the end of the backend
+ */
+static int bit_stream_reach (BitStream* stream)
+{
+  if (stream->failed) return 0;
+
+  if (stream->count / 8 >= stream->window)
+  {
+    bit_stream_flush_block(stream);
+    bit_stream_load_block(stream);
+  }
+
+  if (!stream->failed && stream->count / 8 >= stream->end) stream->failed = 1;
+
+  return !stream->failed;
 }
 
-BitStream* bit_stream_new (int backend, int protocol, Count offset)
+BitStream* bit_stream_new (int backend, int protocol, Count offset, Count window)
 {
   BitStream* stream = (BitStream*)malloc(sizeof(BitStream));
 
   stream->count    = 0;
   stream->offset   = offset;
+  stream->window   = window;
+  stream->remaps   = 0;
+  stream->failed   = 0;
   stream->backend  = backend;
   stream->protocol = protocol;
+  stream->pending  = 0;
+
+  stream->pending_count = 0;
 
   bit_stream_load_block(stream);
 
   return stream;
 }
 
-static void bit_stream_write_byte (BitStream* stream, BitVector* vector, Count shift, Count vector_offset)
+BitStream* bit_stream_new_memory (Byte* memory, int protocol, Count size)
+{
+  BitStream* stream = (BitStream*)malloc(sizeof(BitStream));
+
+  stream->memory_block = memory;
+  stream->count        = 0;
+  stream->offset       = 0;
+  stream->window       = size;
+  stream->end          = size;
+  stream->remaps       = 0;
+  stream->backend      = -1;
+  stream->protocol     = protocol;
+  stream->failed       = 0;
+  stream->pending      = 0;
+
+  stream->pending_count = 0;
+
+  return stream;
+}
+
+/**
+ * Stores `length` bits of `word` at the byte the cursor is on, a whole word in one go unless it would run
+ * past the end of the window
+ */
+static void bit_stream_store (BitStream* stream, Count word, Count length)
 {
-  if (stream->count / 8 >= MAP_SIZE)
+  if (!bit_stream_reach(stream)) return;
+
+  if (length == 64 && stream->count / 8 + sizeof(Count) <= stream->end)
   {
-    bit_stream_flush_block(stream);
-    bit_stream_load_block(stream);
-    bit_stream_write_byte(stream, vector, shift, vector_offset);
+    word = htole64(word);
+
+    memcpy(&stream->memory_block[stream->count / 8], &word, sizeof(Count));
+
+    stream->count += 64;
+
+    return;
   }
-  else
+
+  while (length > 0)
   {
-    Byte* destination = stream->memory_block;
-    Byte* source      = vector->bytes;
+    Count take = length < 8 ? length : 8;
+    Byte* destination;
+
+    if (!bit_stream_reach(stream)) return;
 
-    Byte lower = CUT_LOWER(source[vector_offset / 8    ] >> (8 - shift),     shift);
-    Byte upper = CUT_UPPER(source[vector_offset / 8 + 1] <<      shift , 8 - shift);
+    destination = &stream->memory_block[stream->count / 8];
 
-    destination[stream->count / 8] = lower | upper;
+    *destination = CUT_OFF_LOWER(*destination, take) | CUT_LOWER(word, take);
 
-    stream->count += vector_offset + 8 < shift + vector->count ? 8 : shift + vector->count - vector_offset;
+    word          >>= take;
+    length         -= take;
+    stream->count  += take;
   }
 }
 
+/**
+ * Pending bits are written out before anything else touches the window
+ */
+static void bit_stream_flush_bits (BitStream* stream)
+{
+  if (stream->pending_count == 0) return;
+
+  bit_stream_store(stream, stream->pending, stream->pending_count);
+
+  stream->pending       = 0;
+  stream->pending_count = 0;
+}
+
+static void bit_stream_write_byte (BitStream* stream, BitVector* vector, Count shift, Count vector_offset)
+{
+  Byte* destination;
+  Byte* source = vector->bytes;
+  Byte lower;
+  Byte upper;
+
+  if (!bit_stream_reach(stream)) return;
+
+  destination = stream->memory_block;
+
+  lower = CUT_LOWER(source[vector_offset / 8    ] >> (8 - shift),     shift);
+  upper = CUT_UPPER(source[vector_offset / 8 + 1] <<      shift , 8 - shift);
+
+  destination[stream->count / 8] = lower | upper;
+
+  stream->count += vector_offset + 8 < shift + vector->count ? 8 : shift + vector->count - vector_offset;
+}
+
 void bit_stream_write (BitStream* stream, BitVector* vector)
 {
   Count i;
-  Count shift = stream->count % 8;
+  Count shift;
   Byte left   = 0;
   Byte right  = 0;
 
+  bit_stream_flush_bits(stream);
+
+  shift = stream->count % 8;
+
   if (shift > 0)
   {
     left = stream->memory_block[stream->count / 8] << (8 - shift);
@@ -278,12 +829,54 @@ void bit_stream_write (BitStream* stream, BitVector* vector)
   }
 }
 
+/**
+ * Append the lowest `length` bits of `bits`, first bit first, `length` being below 64. Bits gather in a word
+ * that is only stored once full, so that a store never reaches bytes of whatever follows the stream
+ */
+void bit_stream_write_bits (BitStream* stream, Count bits, Count length)
+{
+  Count total;
+
+  if (length == 0) return;
+
+  bits &= ((Count)1 << length) - 1;
+
+  /**
+   * The word starts on a byte boundary, a partly written byte is taken back into it
+   */
+  if (stream->pending_count == 0 && stream->count % 8 != 0)
+  {
+    if (!bit_stream_reach(stream)) return;
+
+    stream->pending_count = stream->count % 8;
+    stream->pending       = CUT_LOWER(stream->memory_block[stream->count / 8], stream->pending_count);
+    stream->count        -= stream->pending_count;
+  }
+
+  total = stream->pending_count + length;
+
+  stream->pending |= bits << stream->pending_count;
+
+  if (total < 64)
+  {
+    stream->pending_count = total;
+
+    return;
+  }
+
+  bit_stream_store(stream, stream->pending, 64);
+
+  stream->pending       = bits >> (64 - stream->pending_count);
+  stream->pending_count = total - 64;
+}
+
 void bit_stream_read (BitStream* stream, Bit* bit)
 {
-  if (stream->count / 8 >= MAP_SIZE)
+  if (!bit_stream_reach(stream))
   {
-    bit_stream_flush_block(stream);
-    bit_stream_load_block(stream);
+    *bit = ZERO;
+
+    return;
   }
 
   *bit = (stream->memory_block[stream->count / 8] & (1 << (stream->count % 8))) ? ONE : ZERO;
@@ -293,10 +886,64 @@ void bit_stream_read (BitStream* stream, Bit* bit)
 
 void bit_stream_delete (BitStream* stream)
 {
+  bit_stream_flush_bits(stream);
   bit_stream_flush_block(stream);
   free(stream);
 }
 
+/**
+ * Nodes go back to the tree they came from, only what does not fit is freed
+ */
+static void tree_keep_node (Tree* tree, Node* node)
+{
+  if (node->class == &inner_node_class)
+  {
+    tree_keep_node(tree, ((InnerNode*)node)->left);
+    tree_keep_node(tree, ((InnerNode*)node)->right);
+
+    if (tree->spare_inners_count < WORDS) tree->spare_inners[tree->spare_inners_count++] = node;
+    else                                  free(node);
+
+    return;
+  }
+
+  if (tree->spare_leaves_count < WORDS) tree->spare_leaves[tree->spare_leaves_count++] = node;
+  else                                  free(node);
+}
+
+static Node* tree_leaf_node (Tree* tree, const Value value, const Count count)
+{
+  LeafNode* leaf_node;
+
+  if (tree->spare_leaves_count == 0) return (Node*)leaf_node_new(value, count);
+
+  leaf_node = (LeafNode*)tree->spare_leaves[--tree->spare_leaves_count];
+
+  leaf_node->parent.class     = &leaf_node_class;
+  leaf_node->parent.count     = count;
+  leaf_node->parent.bit_count = 0;
+  leaf_node->value = value;
+
+  return (Node*)leaf_node;
+}
+
+static Node* tree_inner_node (Tree* tree, Node* left, Node* right)
+{
+  InnerNode* inner_node;
+
+  if (tree->spare_inners_count == 0) return (Node*)inner_node_new(left, right);
+
+  inner_node = (InnerNode*)tree->spare_inners[--tree->spare_inners_count];
+
+  inner_node->parent.class     = &inner_node_class;
+  inner_node->parent.count     = left->count + right->count;
+  inner_node->parent.bit_count = (left->bit_count + left->count) + (right->bit_count + right->count);
+  inner_node->left  = left;
+  inner_node->right = right;
+
+  return (Node*)inner_node;
+}
+
 static void tree_visit_inner_node (NodeVisitor* visitor, InnerNode* node)
 {
   Tree* tree = (Tree*)visitor;
@@ -341,12 +988,33 @@ static void tree_visit_leaf_node (NodeVisitor* visitor, LeafNode* node)
   }
 
   /**
-   * To avoid overwrites and memory leaks when there are dummy leaf nodes with the same value
+   * To avoid overwrites and memory leaks when there are dummy leaf nodes with the same value,
+   * translations left over from a reset tree are empty and get reused
    */
   if (tree->translations[node->value] == NULL)
   {
     tree->translations[node->value] = bit_vector_copy(tree->path);
   }
+  else if (tree->translations[node->value]->count == 0)
+  {
+    bit_vector_assign(tree->translations[node->value], tree->path);
+  }
+  else
+  {
+    return;
+  }
+
+  tree->lengths[node->value] = tree->path->count;
+  tree->codes[node->value]   = 0;
+
+  if (tree->path->count > tree->longest) tree->longest = tree->path->count;
+
+  if (tree->path->count <= CODE_BITS)
+  {
+    memcpy(&tree->codes[node->value], tree->path->bytes + 1, (tree->path->count + 7) / 8);
+
+    tree->codes[node->value] = le64toh(tree->codes[node->value]) & (((Count)1 << tree->path->count) - 1);
+  }
 }
 
 static void tree_destroy (NodeVisitor* visitor)
@@ -354,7 +1022,7 @@ static void tree_destroy (NodeVisitor* visitor)
   Tree* tree = (Tree*)visitor;
   Count i;
 
-  bit_stream_delete(tree->stream);
+  if (tree->stream) bit_stream_delete(tree->stream);
 
   bit_vector_delete(tree->tree);
   bit_vector_delete(tree->path);
@@ -371,6 +1039,11 @@ static void tree_destroy (NodeVisitor* visitor)
     node_delete(tree->table[i]);
   }
 
+  for (i = 0; i < tree->spare_leaves_count; ++i) free(tree->spare_leaves[i]);
+  for (i = 0; i < tree->spare_inners_count; ++i) free(tree->spare_inners[i]);
+
+  free(tree->decode_table);
+  free(tree->pair_table);
   free(tree);
 }
 
@@ -394,10 +1067,55 @@ Tree* tree_new (void)
 
   tree->bit_count = 0;
   tree->count     = 0;
+  tree->stream    = NULL;
+
+  tree->decode_table = NULL;
+  tree->decode_ready = 0;
+
+  memset(tree->lengths, 0, sizeof(tree->lengths));
+
+  tree->longest    = 0;
+  tree->pair_table = NULL;
+
+  tree->spare_leaves_count = 0;
+  tree->spare_inners_count = 0;
   
   return tree;
 }
 
+/**
+ * Return to the state of a new tree while keeping the allocated vectors and nodes
+ */
+void tree_reset (Tree* tree)
+{
+  Count i;
+
+  for (i = 0; i < tree->count; ++i)
+  {
+    tree_keep_node(tree, tree->table[i]);
+  }
+
+  for (i = 0; i < WORDS; ++i)
+  {
+    if (tree->translations[i]) tree->translations[i]->count = 0;
+  }
+
+  tree->tree->count = 0;
+  tree->path->count = 0;
+
+  tree->bit_count = 0;
+  tree->count     = 0;
+  tree->stream    = NULL;
+
+  tree->decode_ready = 0;
+
+  memset(tree->lengths, 0, sizeof(tree->lengths));
+
+  tree->longest = 0;
+
+  tree_drop_pair_table(tree);
+}
+
 void tree_empty (Tree* tree)
 {
   Count i;
@@ -406,7 +1124,7 @@ void tree_empty (Tree* tree)
 
   for (i = 0; i < tree->count; ++i)
   {
-    tree->table[i] = (Node*)leaf_node_new(i, 0);
+    tree->table[i] = tree_leaf_node(tree, i, 0);
   }
 }
 
@@ -415,6 +1133,11 @@ void tree_register (Tree* tree, const Value value)
   ++tree->table[value]->count;
 }
 
+void tree_register_many (Tree* tree, const Value value, const Count count)
+{
+  tree->table[value]->count += count;
+}
+
 static int tree_compare_nodes (const void* first, const void* second)
 {
   const Node* first_node  = *(const Node**)first;
@@ -437,7 +1160,7 @@ static void tree_clear (Tree* tree)
 
   while (tree->count > 0 && tree->table[tree->count - 1]->count == 0)
   {
-    node_delete(tree->table[tree->count - 1]);
+    tree_keep_node(tree, tree->table[tree->count - 1]);
 
     --tree->count;
   }
@@ -452,7 +1175,7 @@ void tree_build (Tree* tree)
    */
   while (tree->count < 2)
   {
-    tree->table[tree->count] = (Node*)leaf_node_new('\0', 0);
+    tree->table[tree->count] = tree_leaf_node(tree, '\0', 0);
     ++tree->count;
   }
 
@@ -463,7 +1186,7 @@ void tree_build (Tree* tree)
 
   while (tree->count > 1)
   {
-    tree->table[tree->count - 2] = (Node*)inner_node_new(tree->table[tree->count - 2], tree->table[tree->count - 1]);
+    tree->table[tree->count - 2] = tree_inner_node(tree, tree->table[tree->count - 2], tree->table[tree->count - 1]);
 
     /**
      * Two nodes are replaced with their parent, each inner node is represented by 1 bit
@@ -490,13 +1213,22 @@ static Node* tree_load (Tree* tree)
 
   bit_stream_read(tree->stream, &bit);
 
+  /**
+   * A tree over WORDS values has fewer than WORDS inner nodes, anything more is corrupt input
+   */
+  if (bit == ZERO && ++tree->count >= WORDS)
+  {
+    tree->stream->failed = 1;
+    bit = ONE;
+  }
+
   switch (bit)
   {
     case ZERO:
       left  = tree_load(tree);
       right = tree_load(tree);
 
-      return (Node*)inner_node_new(left, right);
+      return tree_inner_node(tree, left, right);
     case ONE:
       for (i = 0; i < sizeof(Value) * 8; ++i)
       {
@@ -505,7 +1237,7 @@ static Node* tree_load (Tree* tree)
 	value |= bit << i;
       }
 
-      return (Node*)leaf_node_new(value, 0);
+      return tree_leaf_node(tree, value, 0);
   }
 
   return NULL;
@@ -521,16 +1253,99 @@ void tree_set_write_stream (Tree* tree, BitStream* stream)
 void tree_set_read_stream (Tree* tree, BitStream* stream)
 {
   tree->stream = stream;
+  tree->count  = 0;
 
   tree->table[0] = tree_load(tree);
   tree->count    = 1;
+
+  tree->decode_ready = 0;
+}
+
+/**
+ * Concatenated codes of every pair of values, code in the low bits and length in the top byte
+ */
+void tree_build_pair_table (Tree* tree)
+{
+  Count first;
+  Count second;
+
+  if (tree->longest > CODE_BITS) return;
+
+  if (tree->pair_table == NULL)
+  {
+    tree->pair_table = (Count*)malloc(WORDS * WORDS * sizeof(Count));
+  }
+
+  for (first = 0; first < WORDS; ++first)
+  {
+    Count* row = &tree->pair_table[first * WORDS];
+
+    for (second = 0; second < WORDS; ++second)
+    {
+      row[second] = (tree->codes[first] | tree->codes[second] << tree->lengths[first]) | (tree->lengths[first] + tree->lengths[second]) << 56;
+    }
+  }
+}
+
+void tree_drop_pair_table (Tree* tree)
+{
+  free(tree->pair_table);
+  tree->pair_table = NULL;
 }
 
 void tree_write (Tree* tree, const Value value)
 {
-  BitVector* translation = tree->translations[value];
+  if (tree->lengths[value] <= CODE_BITS)
+  {
+    bit_stream_write_bits(tree->stream, tree->codes[value], tree->lengths[value]);
+  }
+  else
+  {
+    bit_stream_write(tree->stream, tree->translations[value]);
+  }
+}
+
+Count tree_write_many (Tree* tree, const Value* values, Count count)
+{
+  Count i = 0;
+  Count bit_count = 0;
+
+  if (tree->pair_table)
+  {
+    for (; i + 1 < count; i += 2)
+    {
+      Count pair = tree->pair_table[values[i] * WORDS + values[i + 1]];
+
+      bit_stream_write_bits(tree->stream, pair & (((Count)1 << 56) - 1), pair >> 56);
+
+      bit_count += pair >> 56;
+    }
+  }
+
+  for (; i < count; ++i)
+  {
+    tree_write(tree, values[i]);
+
+    bit_count += tree->lengths[values[i]];
+  }
+
+  return bit_count;
+}
+
+/**
+ * Bits that writing `values` would take, without writing them
+ */
+static Count tree_measure_many (Tree* tree, const Value* values, Count count)
+{
+  Count i;
+  Count bit_count = 0;
+
+  for (i = 0; i < count; ++i)
+  {
+    bit_count += tree->lengths[values[i]];
+  }
 
-  bit_stream_write(tree->stream, translation);
+  return bit_count;
 }
 
 void tree_read (Tree* tree, Value* value)
@@ -553,333 +1368,5558 @@ void tree_read (Tree* tree, Value* value)
   *value = ((LeafNode*)cursor)->value;
 }
 
-void tree_delete (Tree* tree)
+/**
+ * For every DECODE_BITS wide window walk the tree restarting at the root after each leaf
+ */
+static void tree_build_decode_table (Tree* tree)
 {
-  tree->parent.class->destroy((NodeVisitor*)tree);
-}
+  Count window;
 
-File* file_new (const char* name)
-{
-  File* file = (File*)malloc(sizeof(File));
+  if (tree->decode_table == NULL)
+  {
+    tree->decode_table = (DecodeEntry*)malloc((1 << DECODE_BITS) * sizeof(DecodeEntry));
+  }
 
-  file->name = (char*)malloc((strlen(name) + 1) * sizeof(char));
-  strcpy(file->name, name);
+  for (window = 0; window < (1 << DECODE_BITS); ++window)
+  {
+    DecodeEntry* entry = &tree->decode_table[window];
+    Node* cursor = tree->table[0];
+    Count i;
 
-  file->size = 0;
-  file->compressed_size = 0;
-  file->offset = 0;
+    entry->count = 0;
+    entry->bits  = 0;
 
-  return file;
-}
+    for (i = 0; i < DECODE_BITS && entry->count < DECODE_SYMBOLS; ++i)
+    {
+      cursor = (window & (1 << i)) ? ((InnerNode*)cursor)->right : ((InnerNode*)cursor)->left;
 
-void file_open_read (File* file)
-{
-  int c;
+      if (cursor->class == &leaf_node_class)
+      {
+        entry->values[entry->count++] = ((LeafNode*)cursor)->value;
+        entry->bits = i + 1;
 
-  file->backend = fopen(file->name, "rb");
-  file->tree    = tree_new();
+        cursor = tree->table[0];
+      }
+    }
+  }
 
-  tree_empty(file->tree);
+  tree->decode_ready = 1;
+}
 
-  fseek(file->backend, 0, SEEK_SET);
+void tree_read_many (Tree* tree, Value* values, Count count)
+{
+  BitStream* stream = tree->stream;
 
-  c = fgetc(file->backend);
+  /**
+   * Building the table costs about as much as decoding as many values bit by bit as it has entries
+   */
+  if (!tree->decode_ready && count >= 1 << DECODE_BITS && tree->table[0]->class == &inner_node_class)
+  {
+    tree_build_decode_table(tree);
+  }
 
-  while (c != EOF)
+  while (count > 0)
   {
-    tree_register(file->tree, c);
+    Count position = stream->count / 8;
 
-    c = fgetc(file->backend);
-  }
+    /**
+     * Peek needs three bytes inside the current window and the backend, otherwise decode one value the slow way
+     */
+    if (tree->decode_ready && position + 3 <= stream->end)
+    {
+      Byte* bytes  = stream->memory_block + position;
+      Count window = (bytes[0] | bytes[1] << 8 | bytes[2] << 16) >> (stream->count % 8);
+      DecodeEntry* entry = &tree->decode_table[window & ((1 << DECODE_BITS) - 1)];
 
-  tree_build(file->tree);
+      if (entry->count > 0 && entry->count <= count)
+      {
+        memcpy(values, entry->values, entry->count);
 
-  file->size            = ftell(file->backend);
-  file->compressed_size = (file->tree->bit_count + file->tree->table[0]->bit_count + 7) / 8;
+        values        += entry->count;
+        count         -= entry->count;
+        stream->count += entry->bits;
 
-  fseek(file->backend, 0, SEEK_SET);
+        continue;
+      }
+    }
+
+    tree_read(tree, values);
+
+    ++values;
+    --count;
+  }
 }
 
-void file_open_write (File* file)
+void tree_delete (Tree* tree)
 {
-  file->backend = fopen(file->name, "wb+");
-  file->tree    = tree_new();
+  tree->parent.class->destroy((NodeVisitor*)tree);
 }
 
-void file_read (File* file, int backend)
+/**
+ * Threads keep the trees and buffers of the members they finish, so that the next members coded on the same
+ * thread reuse them rather than allocate their own. This matters most to pools working through many small archives
+ */
+#define SPARE_TREES   2
+#define SPARE_BUFFERS 4
+
+/**
+ * The most a thread keeps, no buffer it is given back is larger than a filter frame or a planner sample coded
+ */
+#define SPARES_COST (SPARE_TREES * TREE_COST + SPARE_BUFFERS * (CODER_HEADER + FILTER_FRAME))
+
+typedef struct Spares Spares;
+
+struct Spares
 {
-  Count count = file->size;
+  Tree* trees[SPARE_TREES];
+  Count trees_count;
+  Byte* buffers[SPARE_BUFFERS];
+  Count sizes[SPARE_BUFFERS];
+  Count buffers_count;
+};
 
-  BitStream* stream = bit_stream_new(backend, PROT_READ, file->offset);
+static _Thread_local Spares spares;
 
-  tree_set_read_stream(file->tree, stream);
+static Tree* tree_acquire (void)
+{
+  if (spares.trees_count > 0) return spares.trees[--spares.trees_count];
 
-  while (count > 0)
+  return tree_new();
+}
+
+/**
+ * Trees are kept reset, with their vectors and decode table still allocated. The pair table goes, as
+ * writing uses it whenever it is there
+ */
+static void tree_release (Tree* tree)
+{
+  if (spares.trees_count == SPARE_TREES)
   {
-    Value value;
+    tree_delete(tree);
 
-    tree_read(file->tree, &value);
+    return;
+  }
 
-    fputc((int)value, file->backend);
+  tree_reset(tree);
 
-    --count;
-  }
+  spares.trees[spares.trees_count++] = tree;
 }
 
-void file_write (File* file, int backend)
+/**
+ * Any spare at least as large will do, otherwise the last one grows
+ */
+static Byte* buffer_acquire (Count size)
 {
-  int c;
-  BitStream* stream = bit_stream_new(backend, PROT_READ | PROT_WRITE, file->offset);
-
-  tree_set_write_stream(file->tree, stream);
+  Count i;
+  Byte* buffer;
 
-  c = fgetc(file->backend);
+  for (i = 0; i < spares.buffers_count && spares.sizes[i] < size; ++i);
 
-  while (c != EOF)
+  if (i == spares.buffers_count)
   {
-    tree_write(file->tree, c);
+    if (spares.buffers_count == 0) return (Byte*)malloc(size);
+
+    i = spares.buffers_count - 1;
 
-    c = fgetc(file->backend);
+    spares.buffers[i] = (Byte*)realloc(spares.buffers[i], size);
+    spares.sizes[i]   = size;
   }
-}
 
-void file_delete (File* file)
-{
-  tree_delete(file->tree);
-  fclose(file->backend);
-  free(file->name);
-  free(file);
+  buffer = spares.buffers[i];
+
+  --spares.buffers_count;
+
+  spares.buffers[i] = spares.buffers[spares.buffers_count];
+  spares.sizes[i]   = spares.sizes[spares.buffers_count];
+
+  return buffer;
 }
 
-Archive* archive_new (const char* name)
+static void buffer_release (Byte* buffer, Count size)
 {
-  Archive* archive = (Archive*)malloc(sizeof(Archive));
+  if (spares.buffers_count == SPARE_BUFFERS)
+  {
+    free(buffer);
 
-  archive->name = (char*)malloc((strlen(name) + 1) * sizeof(char));
-  strcpy(archive->name, name);
+    return;
+  }
 
-  archive->files = NULL;
-  archive->files_count = 0;
+  spares.buffers[spares.buffers_count] = buffer;
+  spares.sizes[spares.buffers_count]   = size;
 
-  return archive;
+  ++spares.buffers_count;
 }
 
-void archive_add_file (Archive* archive, const char* file)
+/**
+ * Frees what the calling thread keeps, before it goes away
+ */
+void spares_release (void)
 {
-  archive->files = (File**)realloc(archive->files, (++archive->files_count) * sizeof(File*));
-  archive->files[archive->files_count - 1] = file_new(file);
+  while (spares.trees_count > 0)
+  {
+    tree_delete(spares.trees[--spares.trees_count]);
+  }
+
+  while (spares.buffers_count > 0)
+  {
+    free(spares.buffers[--spares.buffers_count]);
+  }
 }
 
-void archive_compress (Archive* archive)
+Coder* coder_new (void)
 {
-  Count i;
-  Count aligned_offset = 0;
-  Count offset         = 0;
-  Count count          = htonll(archive->files_count);
-  Count head_length    = 0;
-  int backend          = open(archive->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  Coder* coder = (Coder*)malloc(sizeof(Coder));
 
-  #pragma omp parallel for
-  for (i = 0; i < archive->files_count; ++i)
+  coder->tree        = tree_new();
+  coder->input       = NULL;
+  coder->input_size  = 0;
+  coder->output      = NULL;
+  coder->output_size = 0;
+
+  return coder;
+}
+
+/**
+ * Data that would not shrink is stored raw, so nothing ever grows by more than the header
+ */
+Count coder_bound (const Count size)
+{
+  return CODER_HEADER + size;
+}
+
+Count coder_decoded_size (const Byte* source, const Count size)
+{
+  Count decoded_size;
+
+  if (size < CODER_HEADER) return CODER_ERROR;
+
+  memcpy(&decoded_size, source + 1, sizeof(Count));
+
+  return ntohll(decoded_size);
+}
+
+Count coder_encode (Coder* coder, const Byte* source, const Count size, Byte* destination, const Count capacity)
+{
+  Count i;
+  Count compressed_size;
+  Count network_size = htonll(size);
+  BitStream* stream;
+
+  if (capacity < CODER_HEADER) return CODER_ERROR;
+
+  tree_reset(coder->tree);
+  tree_empty(coder->tree);
+
+  for (i = 0; i < size; ++i)
+  {
+    tree_register(coder->tree, source[i]);
+  }
+
+  tree_build(coder->tree);
+
+  compressed_size = (coder->tree->bit_count + coder->tree->table[0]->bit_count + 7) / 8;
+
+  memcpy(destination + 1, &network_size, sizeof(Count));
+
+  if (compressed_size >= size)
+  {
+    if (capacity < CODER_HEADER + size) return CODER_ERROR;
+
+    destination[0] = CODER_RAW;
+    memcpy(destination + CODER_HEADER, source, size);
+
+    return CODER_HEADER + size;
+  }
+
+  if (capacity < CODER_HEADER + compressed_size) return CODER_ERROR;
+
+  destination[0] = CODER_HUFFMAN;
+
+  stream = bit_stream_new_memory(destination + CODER_HEADER, PROT_READ | PROT_WRITE, compressed_size);
+
+  tree_set_write_stream(coder->tree, stream);
+
+  if (size >= PAIR_THRESHOLD) tree_build_pair_table(coder->tree);
+
+  tree_write_many(coder->tree, source, size);
+
+  bit_stream_delete(stream);
+  coder->tree->stream = NULL;
+
+  return CODER_HEADER + compressed_size;
+}
+
+Count coder_decode (Coder* coder, const Byte* source, const Count size, Byte* destination, const Count capacity)
+{
+  Count decoded_size = coder_decoded_size(source, size);
+  int failed;
+  BitStream* stream;
+
+  if (decoded_size == CODER_ERROR || decoded_size > capacity) return CODER_ERROR;
+
+  switch (source[0])
+  {
+    case CODER_RAW:
+      if (size - CODER_HEADER < decoded_size) return CODER_ERROR;
+
+      memcpy(destination, source + CODER_HEADER, decoded_size);
+
+      return decoded_size;
+    case CODER_HUFFMAN:
+      break;
+    default:
+      return CODER_ERROR;
+  }
+
+  tree_reset(coder->tree);
+
+  stream = bit_stream_new_memory((Byte*)source + CODER_HEADER, PROT_READ, size - CODER_HEADER);
+
+  tree_set_read_stream(coder->tree, stream);
+
+  tree_read_many(coder->tree, destination, decoded_size);
+
+  failed = stream->failed;
+
+  bit_stream_delete(stream);
+  coder->tree->stream = NULL;
+
+  return failed ? CODER_ERROR : decoded_size;
+}
+
+static Byte* coder_reserve (Byte** buffer, Count* buffer_size, const Count size)
+{
+  if (*buffer_size < size)
+  {
+    *buffer      = (Byte*)realloc(*buffer, size);
+    *buffer_size = size;
+  }
+
+  return *buffer;
+}
+
+static Count coder_read_fully (CoderRead read, void* user, Byte* buffer, Count size)
+{
+  Count total = 0;
+
+  while (total < size)
+  {
+    Count count = read(user, buffer + total, size - total);
+
+    if (count == 0) break;
+
+    total += count;
+  }
+
+  return total;
+}
+
+/**
+ * Streams are cut into frames of at most CODER_BLOCK bytes, each frame is the length of
+ * an encoded buffer followed by it, and a zero length ends the stream
+ */
+int coder_encode_stream (Coder* coder, CoderRead read, CoderWrite write, void* user)
+{
+  Count length;
+
+  coder_reserve(&coder->input,  &coder->input_size,  CODER_BLOCK);
+  coder_reserve(&coder->output, &coder->output_size, sizeof(Count) + coder_bound(CODER_BLOCK));
+
+  while ((length = coder_read_fully(read, user, coder->input, CODER_BLOCK)) > 0)
+  {
+    Count frame_length = coder_encode(coder, coder->input, length, coder->output + sizeof(Count), coder_bound(CODER_BLOCK));
+    Count network_length = htonll(frame_length);
+
+    memcpy(coder->output, &network_length, sizeof(Count));
+
+    if (write(user, coder->output, sizeof(Count) + frame_length) != 0) return -1;
+
+    if (length < CODER_BLOCK) break;
+  }
+
+  length = 0;
+
+  return write(user, (Byte*)&length, sizeof(Count));
+}
+
+int coder_decode_stream (Coder* coder, CoderRead read, CoderWrite write, void* user)
+{
+  coder_reserve(&coder->output, &coder->output_size, CODER_BLOCK);
+
+  while (1)
+  {
+    Count frame_length;
+    Count length;
+
+    if (coder_read_fully(read, user, (Byte*)&frame_length, sizeof(Count)) != sizeof(Count)) return -1;
+
+    frame_length = ntohll(frame_length);
+
+    if (frame_length == 0) return 0;
+
+    if (frame_length > coder_bound(CODER_BLOCK)) return -1;
+
+    coder_reserve(&coder->input, &coder->input_size, frame_length);
+
+    if (coder_read_fully(read, user, coder->input, frame_length) != frame_length) return -1;
+
+    length = coder_decode(coder, coder->input, frame_length, coder->output, CODER_BLOCK);
+
+    if (length == CODER_ERROR || write(user, coder->output, length) != 0) return -1;
+  }
+}
+
+void coder_delete (Coder* coder)
+{
+  tree_delete(coder->tree);
+  free(coder->input);
+  free(coder->output);
+  free(coder);
+}
+
+static const char* filter_modes[] = { "none", "shuffle", "delta", "xor" };
+
+/**
+ * `none`, `auto`, or a mode followed by the element width: shuffle2, delta4, xor8...
+ */
+Count filter_parse (const char* name)
+{
+  Count mode;
+  Count width;
+  char* end;
+
+  if (strcmp(name, "none") == 0) return FILTER_NONE;
+  if (strcmp(name, "auto") == 0) return FILTER_AUTO;
+
+  for (mode = FILTER_SHUFFLE; mode <= FILTER_XOR; ++mode)
+  {
+    Count length = strlen(filter_modes[mode]);
+
+    if (strncmp(name, filter_modes[mode], length) != 0) continue;
+
+    width = strtoull(name + length, &end, 10);
+
+    if (*end != '\0' || (width != 1 && width != 2 && width != 4 && width != 8)) return FILTER_ERROR;
+
+    if (mode == FILTER_SHUFFLE && width == 1) return FILTER_ERROR;
+
+    return FILTER(mode, width);
+  }
+
+  return FILTER_ERROR;
+}
+
+const char* filter_name (Count filter, char* name, Count size)
+{
+  if      (filter == FILTER_NONE) snprintf(name, size, "none");
+  else if (filter == FILTER_AUTO) snprintf(name, size, "auto");
+  else                            snprintf(name, size, "%s%zu", filter_modes[FILTER_MODE(filter)], FILTER_WIDTH(filter));
+
+  return name;
+}
+
+/**
+ * Elements are little endian whatever the host
+ */
+static Count filter_load (const Byte* bytes, Count width)
+{
+  Count i;
+  Count value = 0;
+
+  for (i = 0; i < width; ++i)
+  {
+    value |= (Count)bytes[i] << (8 * i);
+  }
+
+  return value;
+}
+
+static void filter_store (Byte* bytes, Count value, Count width)
+{
+  Count i;
+
+  for (i = 0; i < width; ++i)
+  {
+    bytes[i] = value >> (8 * i);
+  }
+}
+
+#if defined(__x86_64__)
+
+/**
+ * SSE2 is part of x86-64, AVX2 is checked for at run time
+ */
+static __m128i filter_combine (Count mode, Count width, __m128i first, __m128i second, int subtract)
+{
+  if (mode == FILTER_XOR) return _mm_xor_si128(first, second);
+
+  switch (width)
+  {
+    case 1:  return subtract ? _mm_sub_epi8(first, second)  : _mm_add_epi8(first, second);
+    case 2:  return subtract ? _mm_sub_epi16(first, second) : _mm_add_epi16(first, second);
+    case 4:  return subtract ? _mm_sub_epi32(first, second) : _mm_add_epi32(first, second);
+    default: return subtract ? _mm_sub_epi64(first, second) : _mm_add_epi64(first, second);
+  }
+}
+
+static __m128i filter_broadcast (Count width, Count value)
+{
+  switch (width)
+  {
+    case 1:  return _mm_set1_epi8((char)value);
+    case 2:  return _mm_set1_epi16((short)value);
+    case 4:  return _mm_set1_epi32((int)value);
+    default: return _mm_set1_epi64x((long long)value);
+  }
+}
+
+/**
+ * Both transpositions move 32 bytes at a time: bytes are first grouped by plane within each 128 bit lane,
+ * then the groups of both lanes are put side by side. Returns the number of elements done
+ */
+__attribute__((target("avx2")))
+static Count filter_transpose_avx2 (Count width, const Byte* input, Byte* output, Count count)
+{
+  Count i = 0;
+
+  if (width == 4)
+  {
+    const __m256i bytes = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                           0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m256i words = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    for (; i + 8 <= count; i += 8)
+    {
+      __m256i vector = _mm256_loadu_si256((const __m256i*)(input + 4 * i));
+      __m128i low;
+      __m128i high;
+
+      vector = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(vector, bytes), words);
+      low    = _mm256_castsi256_si128(vector);
+      high   = _mm256_extracti128_si256(vector, 1);
+
+      _mm_storel_epi64((__m128i*)(output + i), low);
+      _mm_storel_epi64((__m128i*)(output + count + i), _mm_unpackhi_epi64(low, low));
+      _mm_storel_epi64((__m128i*)(output + 2 * count + i), high);
+      _mm_storel_epi64((__m128i*)(output + 3 * count + i), _mm_unpackhi_epi64(high, high));
+    }
+  }
+  else if (width == 2)
+  {
+    const __m256i bytes = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+                                           0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+
+    for (; i + 16 <= count; i += 16)
+    {
+      __m256i vector = _mm256_loadu_si256((const __m256i*)(input + 2 * i));
+
+      vector = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(vector, bytes), 0xD8);
+
+      _mm_storeu_si128((__m128i*)(output + i), _mm256_castsi256_si128(vector));
+      _mm_storeu_si128((__m128i*)(output + count + i), _mm256_extracti128_si256(vector, 1));
+    }
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2")))
+static Count filter_gather_avx2 (Count width, const Byte* input, Byte* output, Count count)
+{
+  Count i = 0;
+
+  if (width == 4)
+  {
+    const __m256i bytes = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                           0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m256i words = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i low  = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(input + i)),
+                                        _mm_loadl_epi64((const __m128i*)(input + count + i)));
+      __m128i high = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(input + 2 * count + i)),
+                                        _mm_loadl_epi64((const __m128i*)(input + 3 * count + i)));
+      __m256i vector = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+
+      vector = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(vector, words), bytes);
+
+      _mm256_storeu_si256((__m256i*)(output + 4 * i), vector);
+    }
+  }
+  else if (width == 2)
+  {
+    const __m256i bytes = _mm256_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+                                           0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+
+    for (; i + 16 <= count; i += 16)
+    {
+      __m128i low    = _mm_loadu_si128((const __m128i*)(input + i));
+      __m128i high   = _mm_loadu_si128((const __m128i*)(input + count + i));
+      __m256i vector = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+
+      vector = _mm256_shuffle_epi8(_mm256_permute4x64_epi64(vector, 0xD8), bytes);
+
+      _mm256_storeu_si256((__m256i*)(output + 2 * i), vector);
+    }
+  }
+
+  return i;
+}
+
+#endif
+
+/**
+ * Every element minus, or xor, the element before it
+ */
+static void filter_difference (Count mode, Count width, const Byte* input, Byte* output, Count count)
+{
+  Count i        = 0;
+  Count previous = 0;
+
+#if defined(__x86_64__)
+  if (count > 0)
+  {
+    Count lanes = 16 / width;
+
+    memcpy(output, input, width);
+
+    for (i = 1; i + lanes <= count; i += lanes)
+    {
+      __m128i current = _mm_loadu_si128((const __m128i*)(input + i * width));
+      __m128i before  = _mm_loadu_si128((const __m128i*)(input + (i - 1) * width));
+
+      _mm_storeu_si128((__m128i*)(output + i * width), filter_combine(mode, width, current, before, 1));
+    }
+
+    previous = filter_load(input + (i - 1) * width, width);
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    Count value = filter_load(input + i * width, width);
+
+    filter_store(output + i * width, mode == FILTER_XOR ? value ^ previous : value - previous, width);
+
+    previous = value;
+  }
+}
+
+/**
+ * Running sum, or xor, undoing filter_difference. Vectors are scanned in log steps and carry their last element
+ */
+static void filter_accumulate (Count mode, Count width, const Byte* input, Byte* output, Count count)
+{
+  Count i        = 0;
+  Count previous = 0;
+
+#if defined(__x86_64__)
+  Count lanes   = 16 / width;
+  __m128i carry = _mm_setzero_si128();
+
+  for (; i + lanes <= count; i += lanes)
+  {
+    __m128i vector = _mm_loadu_si128((const __m128i*)(input + i * width));
+
+    if (width <= 1) vector = filter_combine(mode, width, vector, _mm_slli_si128(vector, 1), 0);
+    if (width <= 2) vector = filter_combine(mode, width, vector, _mm_slli_si128(vector, 2), 0);
+    if (width <= 4) vector = filter_combine(mode, width, vector, _mm_slli_si128(vector, 4), 0);
+
+    vector = filter_combine(mode, width, vector, _mm_slli_si128(vector, 8), 0);
+    vector = filter_combine(mode, width, vector, carry, 0);
+
+    _mm_storeu_si128((__m128i*)(output + i * width), vector);
+
+    previous = filter_load(output + (i + lanes - 1) * width, width);
+    carry    = filter_broadcast(width, previous);
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    Count value = filter_load(input + i * width, width);
+
+    value = mode == FILTER_XOR ? value ^ previous : value + previous;
+
+    filter_store(output + i * width, value, width);
+
+    previous = value;
+  }
+}
+
+/**
+ * Byte k of every element goes to plane k
+ */
+static void filter_transpose (Count width, const Byte* input, Byte* output, Count count)
+{
+  Count i = 0;
+  Count k;
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) i = filter_transpose_avx2(width, input, output, count);
+#endif
+
+  for (; i < count; ++i)
+  {
+    for (k = 0; k < width; ++k)
+    {
+      output[k * count + i] = input[i * width + k];
+    }
+  }
+}
+
+static void filter_gather (Count width, const Byte* input, Byte* output, Count count)
+{
+  Count i = 0;
+  Count k;
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) i = filter_gather_avx2(width, input, output, count);
+#endif
+
+  for (; i < count; ++i)
+  {
+    for (k = 0; k < width; ++k)
+    {
+      output[i * width + k] = input[k * count + i];
+    }
+  }
+}
+
+/**
+ * Filters a frame in place, the bytes after the last whole element are left as they are
+ */
+void filter_apply (Count filter, Byte* bytes, Byte* scratch, Count length)
+{
+  Count mode  = FILTER_MODE(filter);
+  Count width = FILTER_WIDTH(filter);
+  Count count;
+
+  if (filter == FILTER_NONE) return;
+
+  count = length / width;
+
+  if (mode != FILTER_SHUFFLE)
+  {
+    filter_difference(mode, width, bytes, scratch, count);
+    memcpy(bytes, scratch, count * width);
+  }
+
+  if (width > 1)
+  {
+    filter_transpose(width, bytes, scratch, count);
+    memcpy(bytes, scratch, count * width);
+  }
+}
+
+void filter_revert (Count filter, Byte* bytes, Byte* scratch, Count length)
+{
+  Count mode  = FILTER_MODE(filter);
+  Count width = FILTER_WIDTH(filter);
+  Count count;
+
+  if (filter == FILTER_NONE) return;
+
+  count = length / width;
+
+  if (width > 1)
+  {
+    filter_gather(width, bytes, scratch, count);
+    memcpy(bytes, scratch, count * width);
+  }
+
+  if (mode != FILTER_SHUFFLE)
+  {
+    filter_accumulate(mode, width, bytes, scratch, count);
+    memcpy(bytes, scratch, count * width);
+  }
+}
+
+File* file_new (const char* name, Budget* budget)
+{
+  File* file = (File*)malloc(sizeof(File));
+
+  file->name = (char*)malloc((strlen(name) + 1) * sizeof(char));
+  strcpy(file->name, name);
+
+  file->backend = NULL;
+  file->tree    = NULL;
+  file->budget  = budget;
+  file->stats   = NULL;
+
+  file->size = 0;
+  file->compressed_size = 0;
+  file->offset = 0;
+  file->hash = HASH_BASIS;
+  file->reference = INDEX_NONE;
+  file->sample = 0;
+  file->base = 0;
+  file->volume = 0;
+
+  file->holes       = NULL;
+  file->holes_count = 0;
+  file->data_size   = 0;
+  file->cursor      = 0;
+  file->hole        = 0;
+
+  file->block_size   = 0;
+  file->blocks       = NULL;
+  file->blocks_count = 0;
+  file->histograms   = NULL;
+  file->block        = NULL;
+  file->registered   = 0;
+
+  file->filter = FILTER_NONE;
+  file->mode   = CODER_HUFFMAN;
+  file->plan   = PLAN_OFF;
+  file->kept   = 0;
+
+  return file;
+}
+
+static void file_add_hole (File* file, Count offset, Count length)
+{
+  /**
+   * Holes arrive in order, adjacent ones are merged
+   */
+  if (file->holes_count > 0 && file->holes[2 * file->holes_count - 2] + file->holes[2 * file->holes_count - 1] == offset)
+  {
+    file->holes[2 * file->holes_count - 1] += length;
+
+    return;
+  }
+
+  file->holes = (Count*)realloc(file->holes, 2 * (file->holes_count + 1) * sizeof(Count));
+
+  file->holes[2 * file->holes_count]     = offset;
+  file->holes[2 * file->holes_count + 1] = length;
+
+  ++file->holes_count;
+}
+
+/**
+ * Holes the filesystem already knows about, shorter ones are read as data
+ */
+static void file_find_holes (File* file)
+{
+  int backend  = fileno(file->backend);
+  Count offset = 0;
+
+  while (offset < file->size)
+  {
+    off_t data = lseek(backend, offset, SEEK_DATA);
+    off_t hole;
+
+    if (data < 0 || (Count)data > file->size) data = file->size;
+
+    if ((Count)data - offset >= ZERO_RUN)
+    {
+      file_add_hole(file, offset, data - offset);
+    }
+
+    if ((Count)data >= file->size) break;
+
+    hole = lseek(backend, data, SEEK_HOLE);
+
+    if (hole < 0) break;
+
+    offset = hole;
+  }
+
+  lseek(backend, 0, SEEK_SET);
+}
+
+static void file_rewind (File* file)
+{
+  file->cursor = 0;
+  file->hole   = 0;
+
+  fseek(file->backend, 0, SEEK_SET);
+}
+
+/**
+ * Read up to `length` bytes of data, never crossing into a hole
+ */
+static Count file_next_data (File* file, Byte* buffer, Count length)
+{
+  while (file->cursor < file->size)
+  {
+    Count limit = file->size;
+    Count count;
+
+    if (file->hole < file->holes_count)
+    {
+      Count offset = file->holes[2 * file->hole];
+
+      if (file->cursor == offset)
+      {
+        file->cursor += file->holes[2 * file->hole + 1];
+        ++file->hole;
+
+        fseek(file->backend, file->cursor, SEEK_SET);
+
+        continue;
+      }
+
+      limit = offset;
+    }
+
+    if (length > limit - file->cursor) length = limit - file->cursor;
+
+    count = fread(buffer, 1, length, file->backend);
+
+    file->cursor += count;
+
+    return count;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads or writes `length` of the encoded bytes starting at `data` among them, at their places around the holes
+ */
+static void file_transfer (File* file, int backend, Count data, Byte* buffer, Count length, int writing)
+{
+  Count i;
+  Count position = data;
+
+  for (i = 0; i < file->holes_count && file->holes[2 * i] <= position; ++i)
+  {
+    position += file->holes[2 * i + 1];
+  }
+
+  while (length > 0)
+  {
+    Count limit = i < file->holes_count ? file->holes[2 * i] : file->size;
+    Count count = limit - position < length ? limit - position : length;
+    ssize_t done = writing ? pwrite(backend, buffer, count, position) : pread(backend, buffer, count, position);
+
+    /**
+     * An input that shrank since it was read is padded, the space reserved for it is final
+     */
+    if (done <= 0)
+    {
+      if (!writing) memset(buffer, 0, length);
+
+      return;
+    }
+
+    buffer   += done;
+    length   -= done;
+    position += done;
+
+    if (position == limit && i < file->holes_count)
+    {
+      position += file->holes[2 * i + 1];
+      ++i;
+    }
+  }
+}
+
+static void file_hash (File* file, const Byte* buffer, Count length)
+{
+  Count i;
+
+  for (i = 0; i < length; ++i)
+  {
+    file->hash ^= buffer[i];
+    file->hash *= HASH_PRIME;
+  }
+}
+
+/**
+ * Only a few chunks are read, from the start to the end of the member. Equal fingerprints are confirmed
+ * byte by byte anyway
+ */
+static void file_fingerprint (File* file)
+{
+  Count slice;
+  Byte* buffer = buffer_acquire(SAMPLE_CHUNK);
+  int input    = open(file->name, O_RDONLY | O_CLOEXEC);
+  Count step   = file->size > SAMPLE_CHUNK ? (file->size - SAMPLE_CHUNK) / (FINGERPRINT_SLICES - 1) : 0;
+
+  for (slice = 0; input >= 0 && slice < FINGERPRINT_SLICES; ++slice)
+  {
+    ssize_t length = pread(input, buffer, SAMPLE_CHUNK, slice * step);
+
+    if (length <= 0) break;
+
+    file_hash(file, buffer, length);
+
+    if (step == 0) break;
+  }
+
+  if (input >= 0) close(input);
+
+  buffer_release(buffer, SAMPLE_CHUNK);
+}
+
+/**
+ * Estimated bits for coding a histogram with a tree of its own: the entropy, a leaf and an inner node
+ * per value and half a byte of padding
+ */
+static double file_block_cost (const Count* histogram)
+{
+  Count i;
+  Count total = 0;
+  double bits = 4;
+
+  for (i = 0; i < WORDS; ++i)
+  {
+    total += histogram[i];
+  }
+
+  for (i = 0; i < WORDS; ++i)
+  {
+    if (histogram[i] == 0) continue;
+
+    bits += histogram[i] * log2((double)total / histogram[i]) + sizeof(Value) * 8 + 2;
+  }
+
+  return bits;
+}
+
+/**
+ * A finished block extends the current run of blocks, unless a tree of its own saves more than its header costs
+ */
+static void file_end_block (File* file)
+{
+  Count i;
+  Count length = (file->registered - 1) % file->block_size + 1;
+
+  if (file->blocks_count > 0)
+  {
+    Count* current = file->histograms + WORDS * (file->blocks_count - 1);
+    Count merged[WORDS];
+
+    for (i = 0; i < WORDS; ++i)
+    {
+      merged[i] = current[i] + file->block[i];
+    }
+
+    if (file_block_cost(merged) <= file_block_cost(current) + file_block_cost(file->block))
+    {
+      memcpy(current, merged, sizeof(merged));
+
+      file->blocks[2 * (file->blocks_count - 1)] += length;
+
+      memset(file->block, 0, WORDS * sizeof(Count));
+
+      return;
+    }
+  }
+
+  ++file->blocks_count;
+
+  file->histograms = (Count*)realloc(file->histograms, WORDS * file->blocks_count * sizeof(Count));
+  file->blocks     = (Count*)realloc(file->blocks, 2 * file->blocks_count * sizeof(Count));
+
+  memcpy(file->histograms + WORDS * (file->blocks_count - 1), file->block, WORDS * sizeof(Count));
+
+  file->blocks[2 * (file->blocks_count - 1)]     = length;
+  file->blocks[2 * (file->blocks_count - 1) + 1] = 0;
+
+  memset(file->block, 0, WORDS * sizeof(Count));
+}
+
+/**
+ * With blocks the values are only counted per block, the whole member is the sum of its blocks.
+ * A NULL buffer stands for `length` zeros
+ */
+static void file_register (File* file, const Byte* buffer, Count length)
+{
+  Count i;
+
+  if (file->block_size == 0)
+  {
+    if (buffer == NULL)
+    {
+      tree_register_many(file->tree, 0, length);
+
+      return;
+    }
+
+    for (i = 0; i < length; ++i)
+    {
+      tree_register(file->tree, buffer[i]);
+    }
+
+    return;
+  }
+
+  while (length > 0)
+  {
+    Count count = file->block_size - file->registered % file->block_size;
+
+    if (count > length) count = length;
+
+    if (buffer == NULL)
+    {
+      file->block[0] += count;
+    }
+    else
+    {
+      for (i = 0; i < count; ++i)
+      {
+        ++file->block[buffer[i]];
+      }
+
+      buffer += count;
+    }
+
+    file->registered += count;
+    length           -= count;
+
+    if (file->registered % file->block_size == 0) file_end_block(file);
+  }
+}
+
+static void file_register_zeros (File* file, Count length)
+{
+  file_register(file, NULL, length);
+}
+
+static void file_end_zero_run (File* file, Count** runs, Count* runs_count, Count offset, Count length)
+{
+  /**
+   * Short runs of zeros are data after all
+   */
+  if (length < ZERO_RUN)
+  {
+    file_register_zeros(file, length);
+
+    return;
+  }
+
+  *runs = (Count*)realloc(*runs, 2 * (*runs_count + 1) * sizeof(Count));
+
+  (*runs)[2 * *runs_count]     = offset;
+  (*runs)[2 * *runs_count + 1] = length;
+
+  ++*runs_count;
+}
+
+static void file_histogram (File* file)
+{
+  Count i;
+  Count j;
+  Count length;
+  Count run_offset  = 0;
+  Count run_length  = 0;
+  Count* runs       = NULL;
+  Count runs_count  = 0;
+  Count* holes      = file->holes;
+  Count holes_count = file->holes_count;
+  Byte* buffer      = buffer_acquire(ZERO_BLOCK);
+
+  while ((length = file_next_data(file, buffer, ZERO_BLOCK)) > 0)
+  {
+    Count offset = file->cursor - length;
+    int zero     = buffer[0] == 0 && memcmp(buffer, buffer + 1, length - 1) == 0;
+
+    if (zero && run_length > 0 && run_offset + run_length == offset)
+    {
+      run_length += length;
+
+      continue;
+    }
+
+    file_end_zero_run(file, &runs, &runs_count, run_offset, run_length);
+
+    run_offset = offset;
+    run_length = zero ? length : 0;
+
+    if (zero) continue;
+
+    file_register(file, buffer, length);
+  }
+
+  file_end_zero_run(file, &runs, &runs_count, run_offset, run_length);
+
+  if (file->block_size > 0 && file->registered % file->block_size != 0)
+  {
+    file_end_block(file);
+  }
+
+  /**
+   * Merge the holes reported by the filesystem with the runs found while reading
+   */
+  file->holes       = NULL;
+  file->holes_count = 0;
+
+  for (i = 0, j = 0; i < holes_count || j < runs_count; )
+  {
+    if (j == runs_count || (i < holes_count && holes[2 * i] < runs[2 * j]))
+    {
+      file_add_hole(file, holes[2 * i], holes[2 * i + 1]);
+
+      ++i;
+    }
+    else
+    {
+      file_add_hole(file, runs[2 * j], runs[2 * j + 1]);
+
+      ++j;
+    }
+  }
+
+  free(holes);
+  free(runs);
+  buffer_release(buffer, ZERO_BLOCK);
+}
+
+/**
+ * Every value keeps a count of at least one, so values missing from the sample still get a code
+ */
+static void file_histogram_sampled (File* file)
+{
+  Count i;
+  Count offset;
+  Byte* buffer = (Byte*)malloc(SAMPLE_CHUNK);
+
+  for (i = 0; i < WORDS; ++i)
+  {
+    tree_register(file->tree, i);
+  }
+
+  for (offset = 0; offset < file->size; offset += file->sample * SAMPLE_CHUNK)
+  {
+    Count length;
+
+    fseek(file->backend, offset, SEEK_SET);
+
+    length = fread(buffer, 1, SAMPLE_CHUNK, file->backend);
+
+    for (i = 0; i < length; ++i)
+    {
+      tree_register(file->tree, buffer[i]);
+    }
+  }
+
+  free(buffer);
+}
+
+/**
+ * Estimated cost of a frame through a filter, with every plane counted as a block of its own
+ */
+static double file_filter_cost (Count filter, const Byte* frame, Byte* bytes, Byte* scratch, Count length)
+{
+  Count i;
+  Count plane;
+  Count width  = filter == FILTER_NONE ? 1 : FILTER_WIDTH(filter);
+  Count stride = length / width;
+  double cost  = 0;
+  Count histogram[WORDS];
+
+  memcpy(bytes, frame, length);
+  filter_apply(filter, bytes, scratch, length);
+
+  for (plane = 0; plane < width; ++plane)
+  {
+    Count end = plane + 1 < width ? (plane + 1) * stride : length;
+
+    memset(histogram, 0, sizeof(histogram));
+
+    for (i = plane * stride; i < end; ++i)
+    {
+      ++histogram[bytes[i]];
+    }
+
+    cost += file_block_cost(histogram);
+  }
+
+  return cost;
+}
+
+/**
+ * The filter that makes a frame the cheapest, `bytes` and `scratch` are as long as the frame
+ */
+static Count file_trial_filter (const Byte* frame, Byte* bytes, Byte* scratch, Count length)
+{
+  static const Count filters[] =
+  {
+    FILTER(FILTER_SHUFFLE, 2), FILTER(FILTER_SHUFFLE, 4), FILTER(FILTER_SHUFFLE, 8),
+    FILTER(FILTER_DELTA, 1),   FILTER(FILTER_DELTA, 2),   FILTER(FILTER_DELTA, 4),   FILTER(FILTER_DELTA, 8),
+    FILTER(FILTER_XOR, 1),     FILTER(FILTER_XOR, 2),     FILTER(FILTER_XOR, 4),     FILTER(FILTER_XOR, 8)
+  };
+
+  Count i;
+  Count best = FILTER_NONE;
+  double best_cost;
+
+  if (length < FILTER_TRIAL) return FILTER_NONE;
+
+  best_cost = file_filter_cost(FILTER_NONE, frame, bytes, scratch, length) * (FILTER_MARGIN - 1) / FILTER_MARGIN;
+
+  for (i = 0; i < sizeof(filters) / sizeof(*filters); ++i)
+  {
+    double cost = file_filter_cost(filters[i], frame, bytes, scratch, length);
+
+    if (cost < best_cost)
+    {
+      best      = filters[i];
+      best_cost = cost;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Every filter is tried on the first frame of data, unless one was asked for
+ */
+static Count file_choose_filter (File* file)
+{
+  Count best;
+  Count length = file->data_size < FILTER_FRAME ? file->data_size : FILTER_FRAME;
+  Byte* frame;
+  Byte* bytes;
+  Byte* scratch;
+
+  if (file->filter != FILTER_AUTO) return file->filter;
+
+  frame   = buffer_acquire(length);
+  bytes   = buffer_acquire(length);
+  scratch = buffer_acquire(length);
+
+  file_transfer(file, fileno(file->backend), 0, frame, length, 0);
+
+  best = file_trial_filter(frame, bytes, scratch, length);
+
+  buffer_release(frame, length);
+  buffer_release(bytes, length);
+  buffer_release(scratch, length);
+
+  return best;
+}
+
+/**
+ * Counts the data again once filtered, the fingerprint stays that of the member itself. Block sizes divide
+ * frames so that each plane of a frame can become a run of its own
+ */
+static void file_histogram_filtered (File* file)
+{
+  Count data;
+  Count length;
+  Count width   = FILTER_WIDTH(file->filter);
+  Byte* frame   = buffer_acquire(FILTER_FRAME);
+  Byte* scratch = buffer_acquire(FILTER_FRAME);
+  int input     = fileno(file->backend);
+
+  tree_reset(file->tree);
+  tree_empty(file->tree);
+
+  free(file->blocks);
+  free(file->histograms);
+
+  file->blocks       = NULL;
+  file->histograms   = NULL;
+  file->blocks_count = 0;
+  file->registered   = 0;
+
+  if (width > 1 && (file->block_size == 0 || FILTER_FRAME / width % file->block_size != 0))
+  {
+    file->block_size = FILTER_FRAME / width;
+  }
+
+  if (file->block_size > 0)
+  {
+    file->block = (Count*)realloc(file->block, WORDS * sizeof(Count));
+
+    memset(file->block, 0, WORDS * sizeof(Count));
+  }
+
+  for (data = 0; data < file->data_size; data += length)
+  {
+    length = file->data_size - data < FILTER_FRAME ? file->data_size - data : FILTER_FRAME;
+
+    file_transfer(file, input, data, frame, length, 0);
+    filter_apply(file->filter, frame, scratch, length);
+    file_register(file, frame, length);
+  }
+
+  if (file->block_size > 0 && file->registered % file->block_size != 0)
+  {
+    file_end_block(file);
+  }
+
+  buffer_release(frame, FILTER_FRAME);
+  buffer_release(scratch, FILTER_FRAME);
+}
+
+typedef enum
+{
+  PLAN_RAW = 0,
+  PLAN_HUFFMAN,
+  PLAN_BLOCKS,
+  PLAN_FILTER,
+  PLAN_MODES
+} PlanMode;
+
+/**
+ * Estimated size of a sample coded in runs of blocks, merged the way file_end_block merges them
+ */
+static Count file_sample_blocks (const Byte* bytes, Count length, Count block_size)
+{
+  Count i;
+  double bits = 0;
+  File sample;
+
+  memset(&sample, 0, sizeof(sample));
+
+  sample.block_size = block_size;
+  sample.block      = (Count*)calloc(WORDS, sizeof(Count));
+
+  file_register(&sample, bytes, length);
+
+  if (sample.registered % block_size != 0) file_end_block(&sample);
+
+  for (i = 0; i < sample.blocks_count; ++i)
+  {
+    bits += file_block_cost(sample.histograms + WORDS * i);
+  }
+
+  free(sample.block);
+  free(sample.blocks);
+  free(sample.histograms);
+
+  return (Count)((bits + 7) / 8);
+}
+
+/**
+ * Times every mode on a sample of the data and keeps the one with the smallest estimated output among those
+ * coding at least `plan` MB/s on one thread, or among all of them when only the ratio counts. Storing the
+ * data as it is always qualifies. Sampled histograms only ever choose between storing and plain coding
+ */
+static void file_choose_mode (File* file)
+{
+  static const char* modes[] = { "raw", "huffman", "blocks", "filter" };
+
+  Count i;
+  Count length;
+  Count bound;
+  Count data_size  = file->size;
+  Count block_size = file->block_size > 0 ? file->block_size : PLAN_BLOCK;
+  Count plane      = file->block_size > 0 ? file->block_size : 0;
+  Count filter     = FILTER_NONE;
+  Count chosen     = PLAN_RAW;
+  Count count      = file->sample > 1 && file->size > file->sample * SAMPLE_CHUNK ? PLAN_BLOCKS : PLAN_MODES;
+  Count sizes[PLAN_MODES];
+  double seconds[PLAN_MODES];
+  double start;
+  char name[16];
+  Byte* sample;
+  Byte* copy;
+  Byte* scratch;
+  Byte* output;
+  Coder coder;
+
+  for (i = 0; i < file->holes_count; ++i)
+  {
+    data_size -= file->holes[2 * i + 1];
+  }
+
+  if (data_size == 0) return;
+
+  length = data_size < PLAN_SAMPLE ? data_size : PLAN_SAMPLE;
+  bound   = coder_bound(length);
+  sample  = buffer_acquire(length);
+  copy    = buffer_acquire(length);
+  scratch = buffer_acquire(length);
+  output  = buffer_acquire(bound);
+
+  /**
+   * Slices keep their offsets within the data modulo 16, so that elements stay aligned
+   */
+  for (i = 0; i < PLAN_SLICES; ++i)
+  {
+    Count position = i * (length / PLAN_SLICES);
+    Count slice    = i + 1 < PLAN_SLICES ? length / PLAN_SLICES : length - position;
+    Count gap      = (data_size - length) * i / (PLAN_SLICES - 1) & ~(Count)15;
+
+    file_transfer(file, fileno(file->backend), position + gap, sample + position, slice, 0);
+  }
+
+  start = stats_clock();
+  memcpy(copy, sample, length);
+  seconds[PLAN_RAW] = stats_clock() - start;
+  sizes[PLAN_RAW]   = length;
+
+  /**
+   * Only the tree of the coder is used, it comes from the spares of the thread
+   */
+  coder.tree = tree_acquire();
+
+  start = stats_clock();
+  sizes[PLAN_HUFFMAN]   = coder_encode(&coder, sample, length, output, bound);
+  seconds[PLAN_HUFFMAN] = stats_clock() - start;
+
+  tree_release(coder.tree);
+
+  if (count > PLAN_BLOCKS)
+  {
+    start = stats_clock();
+    sizes[PLAN_BLOCKS]   = file_sample_blocks(sample, length, block_size);
+    seconds[PLAN_BLOCKS] = seconds[PLAN_HUFFMAN] + stats_clock() - start;
+
+    filter = file->filter != FILTER_AUTO && file->filter != FILTER_NONE ? file->filter : file_trial_filter(sample, copy, scratch, length);
+
+    if (filter == FILTER_NONE) count = PLAN_FILTER;
+  }
+
+  if (count > PLAN_FILTER)
+  {
+    Count width = FILTER_WIDTH(filter);
+
+    /**
+     * The blocks file_histogram_filtered will count in
+     */
+    if (width > 1 && (plane == 0 || FILTER_FRAME / width % plane != 0)) plane = FILTER_FRAME / width;
+    if (plane == 0)                                                      plane = length;
+
+    start = stats_clock();
+    memcpy(copy, sample, length);
+    filter_apply(filter, copy, scratch, length);
+    sizes[PLAN_FILTER]   = file_sample_blocks(copy, length, plane);
+    seconds[PLAN_FILTER] = seconds[PLAN_HUFFMAN] + stats_clock() - start;
+  }
+
+  flockfile(stderr);
+
+  fprintf(stderr, "Plan `%s`", file->name);
+
+  for (i = 0; i < count; ++i)
+  {
+    double rate = seconds[i] > 0 ? length / seconds[i] / 1e6 : HUGE_VAL;
+
+    if ((file->plan == PLAN_RATIO || rate >= file->plan || i == PLAN_RAW) && sizes[i] < sizes[chosen]) chosen = i;
+
+    fprintf(stderr, "%s %s %.2fx %.0f MB/s", i > 0 ? "," : "", i == PLAN_FILTER ? filter_name(filter, name, sizeof(name)) : modes[i],
+            (double)length / sizes[i], rate);
+  }
+
+  fprintf(stderr, " >> %s\n", chosen == PLAN_FILTER ? filter_name(filter, name, sizeof(name)) : modes[chosen]);
+
+  funlockfile(stderr);
+
+  file->mode       = chosen == PLAN_RAW ? CODER_RAW : CODER_HUFFMAN;
+  file->block_size = chosen == PLAN_BLOCKS ? block_size : chosen == PLAN_FILTER ? file->block_size : 0;
+  file->filter     = chosen == PLAN_FILTER ? filter : FILTER_NONE;
+
+  buffer_release(sample, length);
+  buffer_release(copy, length);
+  buffer_release(scratch, length);
+  buffer_release(output, bound);
+}
+
+/**
+ * The amount of data actually encoded
+ */
+static void file_count_data (File* file)
+{
+  Count i;
+
+  file->data_size = file->size;
+
+  for (i = 0; i < file->holes_count; ++i)
+  {
+    file->data_size -= file->holes[2 * i + 1];
+  }
+}
+
+/**
+ * Every run of blocks gets its tree built once to learn its exact size, the runs follow each other on byte boundaries
+ */
+static void file_plan_blocks (File* file)
+{
+  Count i;
+  Count value;
+  Count offset = 0;
+
+  for (i = 0; i < file->blocks_count; ++i)
+  {
+    tree_reset(file->tree);
+    tree_empty(file->tree);
+
+    for (value = 0; value < WORDS; ++value)
+    {
+      tree_register_many(file->tree, value, file->histograms[WORDS * i + value]);
+    }
+
+    tree_build(file->tree);
+
+    file->blocks[2 * i + 1] = offset;
+
+    offset += (file->tree->bit_count + file->tree->table[0]->bit_count + 7) / 8;
+  }
+
+  file->compressed_size = offset;
+}
+
+/**
+ * A single run of blocks is just a plain member
+ */
+static void file_drop_blocks (File* file)
+{
+  Count value;
+
+  if (file->blocks_count == 1)
+  {
+    for (value = 0; value < WORDS; ++value)
+    {
+      tree_register_many(file->tree, value, file->histograms[value]);
+    }
+  }
+
+  free(file->blocks);
+  free(file->histograms);
+
+  file->blocks       = NULL;
+  file->histograms   = NULL;
+  file->blocks_count = 0;
+}
+
+int file_open_read (File* file)
+{
+  Probe probe;
+  double estimate;
+
+  file->backend = fopen(file->name, "rb");
+
+  /**
+   * Files can vanish or turn unreadable between being found and being read
+   */
+  if (file->backend == NULL)
+  {
+    perror(file->name);
+
+    return -1;
+  }
+
+  file->tree = tree_acquire();
+
+  setvbuf(file->backend, NULL, _IOFBF, file->budget->buffer);
+
+  tree_empty(file->tree);
+
+  fseek(file->backend, 0, SEEK_END);
+  file->size = ftell(file->backend);
+  fseek(file->backend, 0, SEEK_SET);
+
+  file_find_holes(file);
+
+  if (file->plan != PLAN_OFF) file_choose_mode(file);
+
+  if (file->mode != CODER_RAW && file->sample > 1 && file->size > file->sample * SAMPLE_CHUNK)
+  {
+    file->block_size = 0;
+    file->filter     = FILTER_NONE;
+
+    stats_start(file->stats, &probe);
+    file_histogram_sampled(file);
+    stats_stop(file->stats, &probe, STAGE_HISTOGRAM, file->size / file->sample);
+
+    stats_start(file->stats, &probe);
+    tree_build(file->tree);
+    stats_stop(file->stats, &probe, STAGE_BUILD, file->size);
+
+    file_count_data(file);
+
+    /**
+     * The exact size is only known once encoded. The code lengths of the sample scaled to the whole member
+     * are the estimate, never more than every value having the longest code
+     */
+    estimate = (double)file->tree->table[0]->bit_count / file->tree->table[0]->count * file->data_size;
+    estimate = estimate + estimate / SAMPLE_MARGIN + 64;
+
+    if (estimate > (double)(file->data_size * file->tree->longest)) estimate = file->data_size * file->tree->longest;
+
+    file->compressed_size = (file->tree->bit_count + (Count)estimate + 7) / 8;
+  }
+  else
+  {
+    file->sample = 0;
+
+    if (file->block_size > 0) file->block = (Count*)calloc(WORDS, sizeof(Count));
+
+    stats_start(file->stats, &probe);
+    file_histogram(file);
+    stats_stop(file->stats, &probe, STAGE_HISTOGRAM, file->size);
+
+    file_count_data(file);
+
+    file->filter = file_choose_filter(file);
+
+    if (file->filter != FILTER_NONE)
+    {
+      stats_start(file->stats, &probe);
+      file_histogram_filtered(file);
+      stats_stop(file->stats, &probe, STAGE_HISTOGRAM, file->data_size);
+    }
+
+    free(file->block);
+    file->block = NULL;
+
+    stats_start(file->stats, &probe);
+
+    if (file->mode == CODER_RAW)
+    {
+      file->compressed_size = file->data_size;
+    }
+    else if (file->blocks_count > 1)
+    {
+      file_plan_blocks(file);
+    }
+    else
+    {
+      file_drop_blocks(file);
+
+      tree_build(file->tree);
+
+      file->compressed_size = (file->tree->bit_count + file->tree->table[0]->bit_count + 7) / 8;
+    }
+
+    stats_stop(file->stats, &probe, STAGE_BUILD, file->size);
+  }
+
+  /**
+   * The input is reopened by file_write, so that idle members do not hold on to their buffers
+   */
+  file_close(file);
+
+  return 0;
+}
+
+/**
+ * Members stored with a relative path are extracted below the current directory
+ */
+static void file_make_parents (const char* name)
+{
+  char* path      = strdup(name);
+  char* separator = path;
+
+  while ((separator = strchr(separator + 1, '/')) != NULL)
+  {
+    *separator = '\0';
+    mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO);
+    *separator = '/';
+  }
+
+  free(path);
+}
+
+/**
+ * Names from an archive are extracted relative to the current directory, so they can be neither absolute
+ * nor climb out of it
+ */
+static int file_name_contained (const char* name)
+{
+  const char* component = name;
+
+  if (*name == '\0' || *name == '/') return 0;
+
+  while (component != NULL)
+  {
+    if (component[0] == '.' && component[1] == '.' && (component[2] == '/' || component[2] == '\0')) return 0;
+
+    component = strchr(component, '/');
+
+    if (component != NULL) ++component;
+  }
+
+  return 1;
+}
+
+void file_open_write (File* file)
+{
+  file->backend = fopen(file->name, "wb+");
+
+  if (file->backend == NULL && errno == ENOENT)
+  {
+    file_make_parents(file->name);
+
+    file->backend = fopen(file->name, "wb+");
+  }
+  file->tree    = tree_acquire();
+
+  setvbuf(file->backend, NULL, _IOFBF, file->budget->buffer);
+}
+
+/**
+ * The tree of a run of blocks, built again from its histogram
+ */
+static Tree* file_block_tree (File* file, Count block)
+{
+  Count value;
+  Tree* tree = tree_acquire();
+
+  tree_empty(tree);
+
+  for (value = 0; value < WORDS; ++value)
+  {
+    tree_register_many(tree, value, file->histograms[WORDS * block + value]);
+  }
+
+  tree_build(tree);
+
+  return tree;
+}
+
+static Count file_write_block (File* file, int backend, int input, Count block, Count data)
+{
+  Count bit_count;
+  Count count  = file->blocks[2 * block];
+  Tree* tree   = file_block_tree(file, block);
+  Byte* buffer = buffer_acquire(file->budget->buffer);
+  BitStream* stream = bit_stream_new(backend, PROT_READ | PROT_WRITE, file->offset + file->blocks[2 * block + 1], file->budget->window);
+
+  tree_set_write_stream(tree, stream);
+
+  bit_count = tree->tree->count;
+
+  if (count >= PAIR_THRESHOLD) tree_build_pair_table(tree);
+
+  while (count > 0)
+  {
+    Count length = count < file->budget->buffer ? count : file->budget->buffer;
+
+    file_transfer(file, input, data, buffer, length, 0);
+
+    bit_count += tree_write_many(tree, buffer, length);
+
+    data  += length;
+    count -= length;
+  }
+
+  if (file->stats)
+  {
+    #pragma omp atomic
+    file->stats->remaps += stream->remaps;
+  }
+
+  bit_stream_delete(stream);
+  tree->stream = NULL;
+
+  tree_release(tree);
+  buffer_release(buffer, file->budget->buffer);
+
+  return bit_count;
+}
+
+static void file_read_block (File* file, int backend, int output, Count block, Count data)
+{
+  Count count  = file->blocks[2 * block];
+  Tree* tree   = tree_acquire();
+  Byte* buffer = buffer_acquire(file->budget->buffer);
+  BitStream* stream = bit_stream_new(backend, PROT_READ, file->offset + file->blocks[2 * block + 1], file->budget->window);
+
+  tree_set_read_stream(tree, stream);
+
+  while (count > 0)
+  {
+    Count length = count < file->budget->buffer ? count : file->budget->buffer;
+
+    tree_read_many(tree, buffer, length);
+
+    file_transfer(file, output, data, buffer, length, 1);
+
+    data  += length;
+    count -= length;
+  }
+
+  if (file->stats)
+  {
+    #pragma omp atomic
+    file->stats->remaps += stream->remaps;
+  }
+
+  bit_stream_delete(stream);
+  tree->stream = NULL;
+
+  tree_release(tree);
+  buffer_release(buffer, file->budget->buffer);
+}
+
+/**
+ * Where each run of blocks starts among the encoded bytes
+ */
+static Count* file_block_starts (File* file)
+{
+  Count i;
+  Count* starts = (Count*)malloc(file->blocks_count * sizeof(Count));
+
+  for (i = 0; i < file->blocks_count; ++i)
+  {
+    starts[i] = i > 0 ? starts[i - 1] + file->blocks[2 * (i - 1)] : 0;
+  }
+
+  return starts;
+}
+
+/**
+ * Runs of blocks start on byte boundaries with trees of their own, so they are coded as independent tasks
+ */
+static void file_write_blocks (File* file, int backend)
+{
+  Count i;
+  Count bit_count = 0;
+  Count* starts   = file_block_starts(file);
+  int input       = open(file->name, O_RDONLY | O_CLOEXEC);
+  Probe probe;
+
+  if (input < 0 && file->data_size > 0) perror(file->name);
+
+  stats_start(file->stats, &probe);
+
+  #pragma omp taskloop shared(bit_count)
+  for (i = 0; i < file->blocks_count; ++i)
+  {
+    Count bits = file_write_block(file, backend, input, i, starts[i]);
+
+    #pragma omp atomic
+    bit_count += bits;
+  }
+
+  if (file->stats) file->stats->bits += bit_count;
+
+  close(input);
+  free(starts);
+
+  stats_stop(file->stats, &probe, STAGE_ENCODE, file->data_size);
+}
+
+static void file_read_blocks (File* file, int backend)
+{
+  Count i;
+  Count* starts = file_block_starts(file);
+  int output    = fileno(file->backend);
+  Probe probe;
+
+  stats_start(file->stats, &probe);
+
+  #pragma omp taskloop
+  for (i = 0; i < file->blocks_count; ++i)
+  {
+    file_read_block(file, backend, output, i, starts[i]);
+  }
+
+  ftruncate(output, file->size);
+
+  free(starts);
+
+  file_close(file);
+
+  stats_stop(file->stats, &probe, STAGE_DECODE, file->size);
+}
+
+/**
+ * Frames are only whole across runs of blocks, so filtered members are coded one frame at a time and move on
+ * to the tree of the next run where it starts. Members without runs are a single run with the tree of the member
+ */
+static void file_write_filtered (File* file, int backend)
+{
+  Count data;
+  Count length;
+  Count bit_count;
+  Count block   = 0;
+  Count end     = file->blocks_count > 0 ? file->blocks[0] : file->data_size;
+  Tree* tree    = file->blocks_count > 0 ? file_block_tree(file, 0) : file->tree;
+  Byte* frame   = buffer_acquire(FILTER_FRAME);
+  Byte* scratch = buffer_acquire(FILTER_FRAME);
+  int input     = open(file->name, O_RDONLY | O_CLOEXEC);
+  BitStream* stream = bit_stream_new(backend, PROT_READ | PROT_WRITE, file->offset, file->budget->window);
+  Probe probe;
+
+  if (input < 0 && file->data_size > 0) perror(file->name);
+
+  stats_start(file->stats, &probe);
+
+  tree_set_write_stream(tree, stream);
+
+  bit_count = tree->tree->count;
+
+  if (end >= PAIR_THRESHOLD) tree_build_pair_table(tree);
+
+  for (data = 0; data < file->data_size; data += length)
+  {
+    Count done = 0;
+
+    length = file->data_size - data < FILTER_FRAME ? file->data_size - data : FILTER_FRAME;
+
+    file_transfer(file, input, data, frame, length, 0);
+    filter_apply(file->filter, frame, scratch, length);
+
+    while (done < length)
+    {
+      Count count;
+
+      if (data + done == end)
+      {
+        if (file->stats) file->stats->remaps += stream->remaps;
+
+        bit_stream_delete(stream);
+        tree->stream = NULL;
+        tree_release(tree);
+
+        ++block;
+
+        tree   = file_block_tree(file, block);
+        stream = bit_stream_new(backend, PROT_READ | PROT_WRITE, file->offset + file->blocks[2 * block + 1], file->budget->window);
+        end   += file->blocks[2 * block];
+
+        tree_set_write_stream(tree, stream);
+
+        bit_count += tree->tree->count;
+
+        if (file->blocks[2 * block] >= PAIR_THRESHOLD) tree_build_pair_table(tree);
+      }
+
+      count = end - (data + done) < length - done ? end - (data + done) : length - done;
+
+      bit_count += tree_write_many(tree, frame + done, count);
+
+      done += count;
+    }
+  }
+
+  if (file->blocks_count == 0) file->compressed_size = (bit_count + 7) / 8;
+
+  if (file->stats)
+  {
+    file->stats->bits   += bit_count;
+    file->stats->remaps += stream->remaps;
+  }
+
+  bit_stream_delete(stream);
+  tree->stream = NULL;
+
+  if (tree != file->tree) tree_release(tree);
+  else                    tree_drop_pair_table(tree);
+
+  close(input);
+  buffer_release(frame, FILTER_FRAME);
+  buffer_release(scratch, FILTER_FRAME);
+
+  stats_stop(file->stats, &probe, STAGE_ENCODE, file->data_size);
+}
+
+/**
+ * Runs are decoded in order into whole frames, which are reverted before going to their places around the holes
+ */
+static void file_read_filtered (File* file, int backend)
+{
+  Count i;
+  Count data;
+  Count length;
+  Count data_size = file->size;
+  Count block     = 0;
+  Count end;
+  Byte* frame   = buffer_acquire(FILTER_FRAME);
+  Byte* scratch = buffer_acquire(FILTER_FRAME);
+  int output    = fileno(file->backend);
+  BitStream* stream = bit_stream_new(backend, PROT_READ, file->offset, file->budget->window);
+  Probe probe;
+
+  stats_start(file->stats, &probe);
+
+  for (i = 0; i < file->holes_count; ++i)
+  {
+    data_size -= file->holes[2 * i + 1];
+  }
+
+  end = file->blocks_count > 0 ? file->blocks[0] : data_size;
+
+  tree_set_read_stream(file->tree, stream);
+
+  for (data = 0; data < data_size; data += length)
+  {
+    Count done = 0;
+
+    length = data_size - data < FILTER_FRAME ? data_size - data : FILTER_FRAME;
+
+    while (done < length)
+    {
+      Count count;
+
+      if (data + done == end)
+      {
+        if (file->stats) file->stats->remaps += stream->remaps;
+
+        bit_stream_delete(stream);
+
+        ++block;
+
+        stream = bit_stream_new(backend, PROT_READ, file->offset + file->blocks[2 * block + 1], file->budget->window);
+        end   += file->blocks[2 * block];
+
+        tree_reset(file->tree);
+        tree_set_read_stream(file->tree, stream);
+      }
+
+      count = end - (data + done) < length - done ? end - (data + done) : length - done;
+
+      tree_read_many(file->tree, frame + done, count);
+
+      done += count;
+    }
+
+    filter_revert(file->filter, frame, scratch, length);
+    file_transfer(file, output, data, frame, length, 1);
+  }
+
+  ftruncate(output, file->size);
+
+  if (file->stats) file->stats->remaps += stream->remaps;
+
+  bit_stream_delete(stream);
+  file->tree->stream = NULL;
+
+  buffer_release(frame, FILTER_FRAME);
+  buffer_release(scratch, FILTER_FRAME);
+
+  file_close(file);
+
+  stats_stop(file->stats, &probe, STAGE_DECODE, file->size);
+}
+
+/**
+ * Stored members are copied as they are from around their holes
+ */
+static void file_write_raw (File* file, int backend)
+{
+  Count data;
+  Count length;
+  Byte* buffer = buffer_acquire(file->budget->buffer);
+  int input    = open(file->name, O_RDONLY | O_CLOEXEC);
+  Probe probe;
+
+  if (input < 0 && file->data_size > 0) perror(file->name);
+
+  stats_start(file->stats, &probe);
+
+  for (data = 0; data < file->data_size; data += length)
+  {
+    length = file->data_size - data < file->budget->buffer ? file->data_size - data : file->budget->buffer;
+
+    file_transfer(file, input, data, buffer, length, 0);
+
+    if (pwrite(backend, buffer, length, file->offset + data) != (ssize_t)length) break;
+  }
+
+  if (file->stats) file->stats->bits += 8 * file->data_size;
+
+  close(input);
+  buffer_release(buffer, file->budget->buffer);
+
+  stats_stop(file->stats, &probe, STAGE_ENCODE, file->data_size);
+}
+
+static void file_read_raw (File* file, int backend)
+{
+  Count data;
+  Count length;
+  Byte* buffer = buffer_acquire(file->budget->buffer);
+  int output   = fileno(file->backend);
+  Probe probe;
+
+  stats_start(file->stats, &probe);
+
+  for (data = 0; data < file->compressed_size; data += length)
+  {
+    length = file->compressed_size - data < file->budget->buffer ? file->compressed_size - data : file->budget->buffer;
+
+    if (pread(backend, buffer, length, file->offset + data) != (ssize_t)length) break;
+
+    file_transfer(file, output, data, buffer, length, 1);
+  }
+
+  ftruncate(output, file->size);
+
+  buffer_release(buffer, file->budget->buffer);
+
+  file_close(file);
+
+  stats_stop(file->stats, &probe, STAGE_DECODE, file->size);
+}
+
+void file_read (File* file, int backend)
+{
+  Count count = file->size;
+  Probe probe;
+  BitStream* stream;
+  Value* buffer;
+
+  if (file->mode == CODER_RAW)
+  {
+    file_read_raw(file, backend);
+
+    return;
+  }
+
+  if (file->filter != FILTER_NONE)
+  {
+    file_read_filtered(file, backend);
+
+    return;
+  }
+
+  if (file->blocks_count > 0)
+  {
+    file_read_blocks(file, backend);
+
+    return;
+  }
+
+  buffer = buffer_acquire(file->budget->buffer);
+
+  stats_start(file->stats, &probe);
+
+  stream = bit_stream_new(backend, PROT_READ, file->offset, file->budget->window);
+
+  tree_set_read_stream(file->tree, stream);
+
+  /**
+   * Seeking over holes in the freshly truncated output leaves them unallocated
+   */
+  for (file->hole = 0; file->hole <= file->holes_count; ++file->hole)
+  {
+    Count offset = file->hole < file->holes_count ? file->holes[2 * file->hole] : file->size;
+
+    count = offset - ftell(file->backend);
+
+    while (count > 0)
+    {
+      Count length = count < file->budget->buffer ? count : file->budget->buffer;
+
+      tree_read_many(file->tree, buffer, length);
+
+      fwrite(buffer, 1, length, file->backend);
+
+      count -= length;
+    }
+
+    if (file->hole < file->holes_count)
+    {
+      fseek(file->backend, offset + file->holes[2 * file->hole + 1], SEEK_SET);
+    }
+  }
+
+  fflush(file->backend);
+  ftruncate(fileno(file->backend), file->size);
+
+  buffer_release(buffer, file->budget->buffer);
+
+  if (file->stats) file->stats->remaps += stream->remaps;
+
+  bit_stream_delete(stream);
+  file->tree->stream = NULL;
+
+  file_close(file);
+
+  stats_stop(file->stats, &probe, STAGE_DECODE, file->size);
+}
+
+/**
+ * Sampled members only have room for their estimate, one that would outgrow it stops short and fails
+ */
+int file_write (File* file, int backend)
+{
+  Count count = file->data_size;
+  Count limit = 8 * file->compressed_size;
+  Count length;
+  Count bit_count;
+  Probe probe;
+  BitStream* stream;
+  Value* buffer;
+  int status = 0;
+
+  if (file->mode == CODER_RAW)
+  {
+    file_write_raw(file, backend);
+
+    return 0;
+  }
+
+  if (file->filter != FILTER_NONE)
+  {
+    file_write_filtered(file, backend);
+
+    return 0;
+  }
+
+  if (file->blocks_count > 0)
+  {
+    file_write_blocks(file, backend);
+
+    return 0;
+  }
+
+  buffer = buffer_acquire(file->budget->buffer);
+
+  stats_start(file->stats, &probe);
+
+  stream = bit_stream_new(backend, PROT_READ | PROT_WRITE, file->offset, file->budget->window);
+
+  file->backend = fopen(file->name, "rb");
+
+  /**
+   * An input gone since it was scanned is coded as if it were empty, the space reserved for it is final
+   */
+  if (file->backend == NULL)
+  {
+    perror(file->name);
+
+    count = 0;
+  }
+  else
+  {
+    setvbuf(file->backend, NULL, _IOFBF, file->budget->buffer);
+  }
+
+  tree_set_write_stream(file->tree, stream);
+
+  bit_count = file->tree->tree->count;
+
+  if (file->data_size >= PAIR_THRESHOLD) tree_build_pair_table(file->tree);
+
+  /**
+   * Never encode more than the histogram accounted for, the space reserved for the member is final
+   */
+  if (file->backend) file_rewind(file);
+
+  while (count > 0 && (length = file_next_data(file, buffer, count < file->budget->buffer ? count : file->budget->buffer)) > 0)
+  {
+    /**
+     * Lengths are only summed up when the longest codes could reach past the reservation
+     */
+    if (file->sample && bit_count + length * file->tree->longest > limit && bit_count + tree_measure_many(file->tree, buffer, length) > limit)
+    {
+      status = -1;
+
+      break;
+    }
+
+    bit_count += tree_write_many(file->tree, buffer, length);
+
+    count -= length;
+  }
+
+  buffer_release(buffer, file->budget->buffer);
+  tree_drop_pair_table(file->tree);
+
+  file->compressed_size = (bit_count + 7) / 8;
+
+  if (file->stats)
+  {
+    file->stats->bits   += bit_count;
+    file->stats->remaps += stream->remaps;
+  }
+
+  /**
+   * Unmap the last window right away rather than keeping one mapping per member until the end
+   */
+  bit_stream_delete(stream);
+  file->tree->stream = NULL;
+
+  file_close(file);
+
+  stats_stop(file->stats, &probe, STAGE_ENCODE, file->data_size - count);
+
+  return status;
+}
+
+void file_close (File* file)
+{
+  if (file->backend)
+  {
+    fclose(file->backend);
+    file->backend = NULL;
+  }
+}
+
+void file_delete (File* file)
+{
+  if (file->tree)  tree_release(file->tree);
+  if (file->stats) stats_delete(file->stats);
+
+  free(file->holes);
+  free(file->blocks);
+  free(file->histograms);
+  file_close(file);
+  free(file->name);
+  free(file);
+}
+
+static Count hash_name (const char* name)
+{
+  Count hash = HASH_BASIS;
+
+  while (*name)
+  {
+    hash ^= (Byte)*name++;
+    hash *= HASH_PRIME;
+  }
+
+  return hash;
+}
+
+/**
+ * Takes a section of count items of size bytes off what is left of the index
+ */
+static int index_section (Count* remaining, Count count, Count size)
+{
+  Count length;
+
+  if (__builtin_mul_overflow(count, size, &length) || length > *remaining) return 0;
+
+  *remaining -= length;
+
+  return 1;
+}
+
+/**
+ * Strings are referenced by offset and length, their terminator has to lie within the strings as well
+ */
+static int index_string (Index* index, Count offset, Count length)
+{
+  return offset < index->strings_count && length < index->strings_count - offset && index->strings[offset + length] == '\0';
+}
+
+/**
+ * The sections the header describes have to lie within the index, they are only located once they are
+ * known to fit. Nothing is read past the header, so opening stays independent of the number of members
+ */
+static int index_check (Index* index, IndexHeader* header)
+{
+  Count remaining = index->length - index->skip - sizeof(IndexHeader) - sizeof(Count);
+
+  index->holes_count   = ntohll(header->holes);
+  index->blocks_count  = ntohll(header->blocks);
+  index->strings_count = ntohll(header->strings);
+
+  if (!index_section(&remaining, index->count, sizeof(IndexEntry)) ||
+      !index_section(&remaining, index->buckets_count, sizeof(Count)) ||
+      !index_section(&remaining, index->holes_count, 2 * sizeof(Count)) ||
+      !index_section(&remaining, index->blocks_count, 2 * sizeof(Count)) ||
+      !index_section(&remaining, index->volumes_count, 2 * sizeof(Count)) ||
+      !index_section(&remaining, index->strings_count, 1))
+  {
+    return 0;
+  }
+
+  index->entries = (IndexEntry*)(header + 1);
+  index->buckets = (Count*)(index->entries + index->count);
+  index->holes   = (Count*)(index->buckets + index->buckets_count);
+  index->blocks  = index->holes + 2 * index->holes_count;
+  index->volumes = index->blocks + 2 * index->blocks_count;
+  index->strings = (char*)(index->volumes + 2 * index->volumes_count);
+
+  /**
+   * Probing masks hashes with the bucket count
+   */
+  return index->buckets_count > 0 && (index->buckets_count & (index->buckets_count - 1)) == 0;
+}
+
+Index* index_open (int backend)
+{
+  Count i;
+  Index* index;
+  IndexHeader* header;
+  Count length;
+  Count end = lseek(backend, 0, SEEK_END);
+  Count start;
+  Count aligned_start;
+
+  if (end < sizeof(IndexHeader) + sizeof(Count))
+  {
+    return NULL;
+  }
+
+  pread(backend, &length, sizeof(Count), end - sizeof(Count));
+  length = ntohll(length);
+
+  if (length < sizeof(IndexHeader) + sizeof(Count) || length > end)
+  {
+    return NULL;
+  }
+
+  start         = end - length;
+  aligned_start = PAGE_SIZE * (start / PAGE_SIZE);
+
+  index = (Index*)malloc(sizeof(Index));
+
+  index->skip         = start - aligned_start;
+  index->length       = end - aligned_start;
+  index->memory_block = mmap(NULL, index->length, PROT_READ, MAP_SHARED, backend, aligned_start);
+
+  if (index->memory_block == MAP_FAILED)
+  {
+    free(index);
+
+    return NULL;
+  }
+
+  header = (IndexHeader*)(index->memory_block + index->skip);
+
+  if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || ntohll(header->version) != INDEX_VERSION)
+  {
+    munmap(index->memory_block, index->length);
+    free(index);
+
+    return NULL;
+  }
+
+  index->count         = ntohll(header->count);
+  index->buckets_count = ntohll(header->buckets);
+  index->volumes_count = ntohll(header->volumes);
+
+  if (!index_check(index, header))
+  {
+    munmap(index->memory_block, index->length);
+    free(index);
+
+    return NULL;
+  }
+
+  /**
+   * Member data in the archive itself ends where the index starts
+   */
+  index->sizes    = (Count*)malloc((index->volumes_count + 1) * sizeof(Count));
+  index->sizes[0] = start;
+
+  for (i = 1; i <= index->volumes_count; ++i)
+  {
+    index->sizes[i] = INDEX_NONE;
+  }
+
+  return index;
+}
+
+Count index_find (Index* index, const char* name)
+{
+  Count i;
+  Count hash = hash_name(name);
+
+  /**
+   * Open addressing with linear probing, empty buckets hold 0 and the rest the entry position + 1
+   */
+  for (i = 0; i < index->buckets_count; ++i)
+  {
+    Count bucket = ntohll(index->buckets[(hash + i) & (index->buckets_count - 1)]);
+
+    const char* found;
+
+    if (bucket == 0 || bucket > index->count)
+    {
+      break;
+    }
+
+    found = index_name(index, bucket - 1);
+
+    if (found && strcmp(found, name) == 0)
+    {
+      return bucket - 1;
+    }
+  }
+
+  return INDEX_NONE;
+}
+
+/**
+ * NULL when the entry's name does not lie within the strings
+ */
+const char* index_name (Index* index, Count position)
+{
+  Count name;
+
+  if (position >= index->count) return NULL;
+
+  name = ntohll(index->entries[position].name);
+
+  return index_string(index, name, ntohll(index->entries[position].name_length)) ? index->strings + name : NULL;
+}
+
+/**
+ * Names of the volumes after the archive itself, counting from one, NULL when not within the strings
+ */
+const char* index_volume (Index* index, Count volume)
+{
+  Count name;
+
+  if (volume == 0 || volume > index->volumes_count) return NULL;
+
+  name = ntohll(index->volumes[2 * (volume - 1)]);
+
+  return index_string(index, name, ntohll(index->volumes[2 * (volume - 1) + 1])) ? index->strings + name : NULL;
+}
+
+/**
+ * Decodes an entry, -1 when anything it refers to lies outside the index
+ */
+int index_entry (Index* index, Count position, IndexEntry* entry)
+{
+  Count i;
+  Count data_size;
+  Count end     = 0;
+  Count covered = 0;
+  IndexEntry* source;
+
+  if (position >= index->count) return -1;
+
+  source = &index->entries[position];
+
+  entry->name            = ntohll(source->name);
+  entry->name_length     = ntohll(source->name_length);
+  entry->size            = ntohll(source->size);
+  entry->compressed_size = ntohll(source->compressed_size);
+  entry->offset          = ntohll(source->offset);
+  entry->reference       = ntohll(source->reference);
+  entry->holes           = ntohll(source->holes);
+  entry->holes_count     = ntohll(source->holes_count);
+  entry->blocks          = ntohll(source->blocks);
+  entry->blocks_count    = ntohll(source->blocks_count);
+  entry->volume          = ntohll(source->volume);
+  entry->filter          = ntohll(source->filter);
+  entry->mode            = ntohll(source->mode);
+
+  if (!index_string(index, entry->name, entry->name_length) ||
+      entry->holes > index->holes_count || entry->holes_count > index->holes_count - entry->holes ||
+      entry->blocks > index->blocks_count || entry->blocks_count > index->blocks_count - entry->blocks ||
+      entry->volume > index->volumes_count ||
+      (entry->reference != INDEX_NONE && entry->reference >= index->count))
+  {
+    return -1;
+  }
+
+  /**
+   * The coded data lies within its volume, holes within the member in order, and the runs cover exactly
+   * the data between the holes
+   */
+  if (index->sizes[entry->volume] != INDEX_NONE &&
+      (entry->offset > index->sizes[entry->volume] || entry->compressed_size > index->sizes[entry->volume] - entry->offset))
+  {
+    return -1;
+  }
+
+  data_size = entry->size;
+
+  for (i = 0; i < entry->holes_count; ++i)
+  {
+    Count start  = ntohll(index->holes[2 * (entry->holes + i)]);
+    Count length = ntohll(index->holes[2 * (entry->holes + i) + 1]);
+
+    if (start < end || start > entry->size || length > entry->size - start) return -1;
+
+    end        = start + length;
+    data_size -= length;
+  }
+
+  for (i = 0; i < entry->blocks_count; ++i)
+  {
+    Count length = ntohll(index->blocks[2 * (entry->blocks + i)]);
+    Count offset = ntohll(index->blocks[2 * (entry->blocks + i) + 1]);
+
+    if (length > data_size - covered || offset > entry->compressed_size) return -1;
+
+    covered += length;
+  }
+
+  if (entry->blocks_count > 0 && covered != data_size) return -1;
+
+  return 0;
+}
+
+/**
+ * Records where the data of every volume ends, so that entries are checked against them as well
+ */
+void index_bound_volumes (Index* index, const int* backends)
+{
+  Count i;
+
+  for (i = 1; i <= index->volumes_count; ++i)
+  {
+    struct stat status;
+
+    index->sizes[i] = fstat(backends[i], &status) == 0 ? (Count)status.st_size : 0;
+  }
+}
+
+void index_holes (Index* index, IndexEntry* entry, Count* holes)
+{
+  Count i;
+
+  for (i = 0; i < 2 * entry->holes_count; ++i)
+  {
+    holes[i] = ntohll(index->holes[2 * entry->holes + i]);
+  }
+}
+
+void index_blocks (Index* index, IndexEntry* entry, Count* blocks)
+{
+  Count i;
+
+  for (i = 0; i < 2 * entry->blocks_count; ++i)
+  {
+    blocks[i] = ntohll(index->blocks[2 * entry->blocks + i]);
+  }
+}
+
+void index_close (Index* index)
+{
+  munmap(index->memory_block, index->length);
+  free(index->sizes);
+  free(index);
+}
+
+static int write_all (int backend, const void* buffer, Count length)
+{
+  const Byte* cursor = (const Byte*)buffer;
+
+  while (length > 0)
+  {
+    ssize_t written = write(backend, cursor, length);
+
+    if (written <= 0) return -1;
+
+    cursor += written;
+    length -= written;
+  }
+
+  return 0;
+}
+
+static int file_equal (File* first, File* second)
+{
+  int equal = 1;
+  FILE* left  = fopen(first->name,  "rb");
+  FILE* right = fopen(second->name, "rb");
+  Byte* left_buffer  = (Byte*)malloc(COPY_SIZE);
+  Byte* right_buffer = (Byte*)malloc(COPY_SIZE);
+
+  while (equal && left && right)
+  {
+    Count left_count  = fread(left_buffer,  1, COPY_SIZE, left);
+    Count right_count = fread(right_buffer, 1, COPY_SIZE, right);
+
+    equal = left_count == right_count && memcmp(left_buffer, right_buffer, left_count) == 0;
+
+    if (left_count < COPY_SIZE) break;
+  }
+
+  if (left)  fclose(left);
+  if (right) fclose(right);
+
+  free(left_buffer);
+  free(right_buffer);
+
+  return equal && left && right;
+}
+
+/**
+ * Clone the extents of an extracted member when the filesystem supports reflinks and copy it otherwise
+ */
+static int file_copy (File* source, File* destination)
+{
+  int from;
+  int to;
+  int status = 0;
+
+  /**
+   * A member requested twice is already in place
+   */
+  if (strcmp(source->name, destination->name) == 0) return 0;
+
+  file_make_parents(destination->name);
+
+  from = open(source->name,      O_RDONLY);
+  to   = open(destination->name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+  if (from < 0 || to < 0)
+  {
+    status = -1;
+  }
+  else if (ioctl(to, FICLONE, from) != 0)
+  {
+    Count count = source->size;
+
+    while (count > 0)
+    {
+      ssize_t copied = copy_file_range(from, NULL, to, NULL, count, 0);
+
+      if (copied <= 0)
+      {
+        Byte* buffer = (Byte*)malloc(COPY_SIZE);
+        ssize_t length;
+
+        while (status == 0 && (length = read(from, buffer, COPY_SIZE)) > 0)
+        {
+          status = write_all(to, buffer, length);
+        }
+
+        if (length < 0) status = -1;
+
+        free(buffer);
+
+        break;
+      }
+
+      count -= copied;
+    }
+  }
+
+  if (from >= 0) close(from);
+  if (to   >= 0) close(to);
+
+  if (status != 0)
+  {
+    fprintf(stderr, "File `%s` could not be copied from `%s`\n", destination->name, source->name);
+  }
+
+  return status;
+}
+
+static const char* stage_names[STAGE_COUNT] =
+{
+  "histogram", "build", "encode", "decode"
+};
+
+static void stats_print_human (Stats* stats, const char* name)
+{
+  Count i;
+
+  fprintf(stderr, "%s\n", name);
+
+  for (i = 0; i < STAGE_COUNT; ++i)
+  {
+    if (stats->bytes[i] == 0 && stats->seconds[i] == 0) continue;
+
+    fprintf(stderr, "  %-9s %10.6f s %12zu bytes %10.2f MB/s\n", stage_names[i], stats->seconds[i], stats->bytes[i],
+            stats->seconds[i] > 0 ? stats->bytes[i] / stats->seconds[i] / 1e6 : 0);
+  }
+
+  fprintf(stderr, "  %zu bits, %zu window remaps, %zu minor and %zu major page faults\n",
+          stats->bits, stats->remaps, stats->minor_faults, stats->major_faults);
+}
+
+static void json_print_string (const char* string)
+{
+  fputc('"', stderr);
+
+  for (; *string; ++string)
+  {
+    if (*string == '"' || *string == '\\')   fprintf(stderr, "\\%c", *string);
+    else if ((Byte)*string < 0x20)           fprintf(stderr, "\\u%04x", (Byte)*string);
+    else                                     fputc(*string, stderr);
+  }
+
+  fputc('"', stderr);
+}
+
+static void stats_print_json (Stats* stats)
+{
+  Count i;
+
+  fprintf(stderr, "{");
+
+  for (i = 0; i < STAGE_COUNT; ++i)
+  {
+    fprintf(stderr, "\"%s\":{\"seconds\":%.6f,\"bytes\":%zu},", stage_names[i], stats->seconds[i], stats->bytes[i]);
+  }
+
+  fprintf(stderr, "\"bits\":%zu,\"remaps\":%zu,\"minor_faults\":%zu,\"major_faults\":%zu}",
+          stats->bits, stats->remaps, stats->minor_faults, stats->major_faults);
+}
+
+/**
+ * Per member stats, their sum and how busy each thread was over the whole operation, on stderr
+ */
+static void archive_report (Archive* archive)
+{
+  Count i;
+  Profile* profile = archive->profile;
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    stats_merge(&profile->total, archive->files[i]->stats);
+  }
+
+  if (profile->format == STATS_JSON)
+  {
+    fprintf(stderr, "{\"archive\":");
+    json_print_string(archive->name);
+    fprintf(stderr, ",\"wall\":%.6f,\"members\":[", profile->wall);
+
+    for (i = 0; i < archive->files_count; ++i)
+    {
+      fprintf(stderr, "%s{\"name\":", i ? "," : "");
+      json_print_string(archive->files[i]->name);
+      fprintf(stderr, ",\"stats\":");
+      stats_print_json(archive->files[i]->stats);
+      fprintf(stderr, "}");
+    }
+
+    fprintf(stderr, "],\"total\":");
+    stats_print_json(&profile->total);
+    fprintf(stderr, ",\"threads\":[");
+
+    for (i = 0; i < profile->threads; ++i)
+    {
+      fprintf(stderr, "%s{\"busy\":%.6f,\"utilisation\":%.4f}", i ? "," : "", profile->busy[i],
+              profile->wall > 0 ? profile->busy[i] / profile->wall : 0);
+    }
+
+    fprintf(stderr, "]}\n");
+
+    return;
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    char* name = (char*)malloc(strlen(archive->files[i]->name) + 16);
+
+    sprintf(name, "Member `%s`", archive->files[i]->name);
+    stats_print_human(archive->files[i]->stats, name);
+
+    free(name);
+  }
+
+  stats_print_human(&profile->total, "Total");
+
+  fprintf(stderr, "Wall %.6f s\n", profile->wall);
+
+  for (i = 0; i < profile->threads; ++i)
+  {
+    fprintf(stderr, "  thread %zu %10.6f s busy, %5.1f%% utilised\n", i, profile->busy[i],
+            profile->wall > 0 ? 100 * profile->busy[i] / profile->wall : 0);
+  }
+}
+
+Archive* archive_new (const char* name, Budget* budget)
+{
+  Archive* archive = (Archive*)malloc(sizeof(Archive));
+
+  archive->name = (char*)malloc((strlen(name) + 1) * sizeof(char));
+  strcpy(archive->name, name);
+
+  archive->budget  = budget;
+  archive->profile = NULL;
+
+  archive->files = NULL;
+  archive->files_count = 0;
+  archive->files_capacity = 0;
+
+  archive->directories = NULL;
+  archive->directories_count = 0;
+
+  archive->targets = NULL;
+  archive->targets_count = 0;
+  archive->volume_limit = 0;
+  archive->volumes = NULL;
+  archive->volumes_count = 0;
+
+  archive->sample     = 0;
+  archive->block_size = 0;
+  archive->filter     = FILTER_NONE;
+  archive->plan       = PLAN_OFF;
+
+  return archive;
+}
+
+File* archive_add_file (Archive* archive, const char* file)
+{
+  File* member     = file_new(file, archive->budget);
+  const char* base = strrchr(file, '/');
+
+  member->base = base ? (Count)(base + 1 - file) : 0;
+
+  if (archive->profile)
+  {
+    member->stats = stats_new();
+  }
+
+  /**
+   * Directory walks add members from several threads at once
+   */
+  #pragma omp critical (archive)
+  {
+    if (archive->files_count == archive->files_capacity)
+    {
+      archive->files_capacity = archive->files_capacity ? 2 * archive->files_capacity : 16;
+      archive->files = (File**)realloc(archive->files, archive->files_capacity * sizeof(File*));
+    }
+
+    archive->files[archive->files_count++] = member;
+  }
+
+  return member;
+}
+
+void archive_add_directory (Archive* archive, const char* directory)
+{
+  archive->directories = (char**)realloc(archive->directories, (++archive->directories_count) * sizeof(char*));
+  archive->directories[archive->directories_count - 1] = strdup(directory);
+}
+
+/**
+ * Volumes written to a target keep its absolute path, so that the archive can be read from anywhere
+ */
+void archive_add_target (Archive* archive, const char* target)
+{
+  char* path = realpath(target, NULL);
+
+  archive->targets = (char**)realloc(archive->targets, (++archive->targets_count) * sizeof(char*));
+  archive->targets[archive->targets_count - 1] = path ? path : strdup(target);
+}
+
+/**
+ * Relative volume names are relative to the directory of the archive
+ */
+static char* archive_volume_path (const char* archive, const char* volume)
+{
+  const char* separator = strrchr(archive, '/');
+  char* path;
+
+  if (volume[0] == '/' || separator == NULL) return strdup(volume);
+
+  path = (char*)malloc(separator - archive + strlen(volume) + 2);
+  sprintf(path, "%.*s/%s", (int)(separator - archive), archive, volume);
+
+  return path;
+}
+
+/**
+ * The archive's own backend followed by one per volume, NULL when any volume can not be opened
+ */
+static int* archive_open_volumes (const char* archive, int backend, const char** volumes, Count count, int flags)
+{
+  Count i;
+  int* backends = (int*)malloc((count + 1) * sizeof(int));
+
+  backends[0] = backend;
+
+  for (i = 0; i < count; ++i)
+  {
+    char* path = archive_volume_path(archive, volumes[i]);
+
+    backends[i + 1] = open(path, flags | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (backends[i + 1] < 0)
+    {
+      fprintf(stderr, "Volume `%s` can not be opened\n", path);
+
+      while (i > 0) close(backends[i--]);
+
+      free(path);
+      free(backends);
+
+      return NULL;
+    }
+
+    free(path);
+  }
+
+  return backends;
+}
+
+static void archive_close_volumes (int* backends, Count count)
+{
+  Count i;
+
+  for (i = 1; i <= count; ++i)
+  {
+    close(backends[i]);
+  }
+
+  free(backends);
+}
+
+/**
+ * Volume names as stored in an index, NULL when any of them is corrupt
+ */
+static const char** archive_index_volumes (Index* index)
+{
+  Count i;
+  const char** volumes = (const char**)malloc((index->volumes_count + 1) * sizeof(char*));
+
+  for (i = 0; i < index->volumes_count; ++i)
+  {
+    volumes[i] = index_volume(index, i + 1);
+
+    if (volumes[i] == NULL)
+    {
+      free(volumes);
+
+      return NULL;
+    }
+  }
+
+  return volumes;
+}
+
+/**
+ * The path relative to the directory holding the member, or holding the directory it was found in
+ */
+static const char* file_stored_name (File* file)
+{
+  return file->name + file->base;
+}
+
+static void archive_write_index (Archive* archive, int backend, Count offset)
+{
+  Count i;
+  Count j;
+  Count strings  = 0;
+  Count buckets  = 1;
+  Count holes    = 0;
+  Count blocks   = 0;
+  Count length;
+  Byte* memory_block;
+  IndexHeader* header;
+  IndexEntry*  entries;
+  Count*       table;
+  Count*       extents;
+  Count*       runs;
+  Count*       volumes;
+  char*        names;
+
+  for (i = 0; i < archive->volumes_count; ++i)
+  {
+    strings += strlen(archive->volumes[i]) + 1;
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    strings += strlen(file_stored_name(archive->files[i])) + 1;
+    holes   += archive->files[i]->holes_count;
+    blocks  += archive->files[i]->blocks_count;
+  }
+
+  /**
+   * Keep the load factor at or below one half so that probe sequences stay short
+   */
+  while (buckets < 2 * archive->files_count)
+  {
+    buckets <<= 1;
+  }
+
+  /**
+   * Pad the string table so that the trailing length and the next header stay aligned
+   */
+  strings = sizeof(Count) * ((strings + sizeof(Count) - 1) / sizeof(Count));
+
+  length = sizeof(IndexHeader) + archive->files_count * sizeof(IndexEntry) + (buckets + 2 * holes + 2 * blocks + 2 * archive->volumes_count) * sizeof(Count) + strings + sizeof(Count);
+
+  memory_block = (Byte*)calloc(length, 1);
+
+  header  = (IndexHeader*)memory_block;
+  entries = (IndexEntry*)(header + 1);
+  table   = (Count*)(entries + archive->files_count);
+  extents = table + buckets;
+  runs    = extents + 2 * holes;
+  volumes = runs + 2 * blocks;
+  names   = (char*)(volumes + 2 * archive->volumes_count);
+
+  memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+  header->version = htonll((Count)INDEX_VERSION);
+  header->count   = htonll(archive->files_count);
+  header->buckets = htonll(buckets);
+  header->holes   = htonll(holes);
+  header->blocks  = htonll(blocks);
+  header->volumes = htonll(archive->volumes_count);
+  header->strings = htonll(strings);
+
+  strings = 0;
+  holes   = 0;
+  blocks  = 0;
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file       = archive->files[i];
+    const char* name = file_stored_name(file);
+    Count name_length = strlen(name);
+    Count hash        = hash_name(name);
+
+    entries[i].name            = htonll(strings);
+    entries[i].name_length     = htonll(name_length);
+    entries[i].size            = htonll(file->size);
+    entries[i].compressed_size = htonll(file->compressed_size);
+    entries[i].offset          = htonll(file->offset);
+    entries[i].reference       = htonll(file->reference);
+    entries[i].holes           = htonll(holes);
+    entries[i].holes_count     = htonll(file->holes_count);
+
+    for (j = 0; j < 2 * file->holes_count; ++j)
+    {
+      extents[2 * holes + j] = htonll(file->holes[j]);
+    }
+
+    holes += file->holes_count;
+
+    entries[i].blocks       = htonll(blocks);
+    entries[i].blocks_count = htonll(file->blocks_count);
+    entries[i].volume       = htonll(file->volume);
+    entries[i].filter       = htonll(file->filter);
+    entries[i].mode         = htonll(file->mode);
+
+    for (j = 0; j < 2 * file->blocks_count; ++j)
+    {
+      runs[2 * blocks + j] = htonll(file->blocks[j]);
+    }
+
+    blocks += file->blocks_count;
+
+    memcpy(names + strings, name, name_length + 1);
+    strings += name_length + 1;
+
+    /**
+     * Later duplicates of a name shadow nothing, the first occurrence wins
+     */
+    while (table[hash & (buckets - 1)] != 0)
+    {
+      if (strcmp(names + ntohll(entries[ntohll(table[hash & (buckets - 1)]) - 1].name), name) == 0) break;
+
+      ++hash;
+    }
+
+    if (table[hash & (buckets - 1)] == 0)
+    {
+      table[hash & (buckets - 1)] = htonll(i + 1);
+    }
+  }
+
+  for (i = 0; i < archive->volumes_count; ++i)
+  {
+    Count name_length = strlen(archive->volumes[i]);
+
+    volumes[2 * i]     = htonll(strings);
+    volumes[2 * i + 1] = htonll(name_length);
+
+    memcpy(names + strings, archive->volumes[i], name_length + 1);
+    strings += name_length + 1;
+  }
+
+  *(Count*)(memory_block + length - sizeof(Count)) = htonll(length);
+
+  /**
+   * Members end at an arbitrary byte, pad so that the mapped index is aligned
+   */
+  offset = sizeof(Count) * ((offset + sizeof(Count) - 1) / sizeof(Count));
+
+  ftruncate(backend, offset);
+  lseek(backend, offset, SEEK_SET);
+  write_all(backend, memory_block, length);
+
+  free(memory_block);
+}
+
+typedef struct Fingerprint Fingerprint;
+
+struct Fingerprint
+{
+  Count size;
+  Count hash;
+  Count position;
+};
+
+static int compare_fingerprints (const void* first, const void* second)
+{
+  const Fingerprint* first_fingerprint  = (const Fingerprint*)first;
+  const Fingerprint* second_fingerprint = (const Fingerprint*)second;
+
+  if (first_fingerprint->size     != second_fingerprint->size)     return first_fingerprint->size     < second_fingerprint->size     ? -1 : 1;
+  if (first_fingerprint->hash     != second_fingerprint->hash)     return first_fingerprint->hash     < second_fingerprint->hash     ? -1 : 1;
+  if (first_fingerprint->position != second_fingerprint->position) return first_fingerprint->position < second_fingerprint->position ? -1 : 1;
+
+  return 0;
+}
+
+/**
+ * Runs before any member is scanned. Only members sharing their size get a fingerprint, and members with the
+ * same size and fingerprint are compared byte by byte. Confirmed copies refer to the earliest identical member
+ * and are neither scanned nor encoded
+ */
+static void archive_deduplicate (Archive* archive)
+{
+  Count i;
+  Count j;
+  Count k;
+  Fingerprint* fingerprints = (Fingerprint*)malloc(archive->files_count * sizeof(Fingerprint));
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    fingerprints[i].size     = archive->files[i]->size;
+    fingerprints[i].hash     = HASH_BASIS;
+    fingerprints[i].position = i;
+  }
+
+  qsort(fingerprints, archive->files_count, sizeof(Fingerprint), compare_fingerprints);
+
+  #pragma omp parallel for schedule(dynamic) num_threads(archive->budget->streams)
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[fingerprints[i].position];
+
+    if (file->size == 0) continue;
+
+    if ((i > 0 && fingerprints[i - 1].size == file->size) || (i + 1 < archive->files_count && fingerprints[i + 1].size == file->size))
+    {
+      file_fingerprint(file);
+    }
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    fingerprints[i].hash = archive->files[fingerprints[i].position]->hash;
+  }
+
+  qsort(fingerprints, archive->files_count, sizeof(Fingerprint), compare_fingerprints);
+
+  for (i = 0; i < archive->files_count; i = j)
+  {
+    for (j = i + 1; j < archive->files_count; ++j)
+    {
+      File* file = archive->files[fingerprints[j].position];
+
+      if (fingerprints[j].size != fingerprints[i].size || fingerprints[j].hash != fingerprints[i].hash) break;
+
+      for (k = i; k < j; ++k)
+      {
+        File* original = archive->files[fingerprints[k].position];
+
+        if (original->reference == INDEX_NONE && file_equal(original, file))
+        {
+          file->reference = fingerprints[k].position;
+
+          break;
+        }
+      }
+    }
+  }
+
+  free(fingerprints);
+}
+
+static Count archive_new_volume (Archive* archive, Count slot)
+{
+  const char* base = strrchr(archive->name, '/');
+  char* name;
+
+  base = base ? base + 1 : archive->name;
+
+  ++archive->volumes_count;
+
+  if (archive->targets_count > 0)
+  {
+    name = (char*)malloc(strlen(archive->targets[slot]) + strlen(base) + 32);
+    sprintf(name, "%s/%s.%zu", archive->targets[slot], base, archive->volumes_count);
+  }
+  else
+  {
+    name = (char*)malloc(strlen(base) + 32);
+    sprintf(name, "%s.%zu", base, archive->volumes_count);
+  }
+
+  archive->volumes = (char**)realloc(archive->volumes, archive->volumes_count * sizeof(char*));
+  archive->volumes[archive->volumes_count - 1] = name;
+
+  return archive->volumes_count;
+}
+
+/**
+ * Lays members out one after the other, either in the archive itself or striped over volumes by always
+ * filling the emptiest of the volumes currently open on each target
+ */
+static void archive_place (Archive* archive)
+{
+  Count i;
+  Count slot;
+  Count slots    = archive->targets_count > 0 ? archive->targets_count : 1;
+  Count* current = (Count*)calloc(slots, sizeof(Count));
+  Count* used    = (Count*)calloc(1, sizeof(Count));
+  int striped    = archive->targets_count > 0 || archive->volume_limit > 0;
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+    Count volume;
+
+    if (file->reference != INDEX_NONE)
+    {
+      file->compressed_size = 0;
+
+      printf("File `%s` is a copy of `%s`\n", file->name, archive->files[file->reference]->name);
+
+      continue;
+    }
+
+    if (striped)
+    {
+      Count emptiest = 0;
+
+      for (slot = 1; slot < slots; ++slot)
+      {
+        if (current[slot] == 0 || (current[emptiest] != 0 && used[current[slot]] < used[current[emptiest]])) emptiest = slot;
+      }
+
+      volume = current[emptiest];
+
+      if (volume == 0 || (archive->volume_limit > 0 && used[volume] > 0 && used[volume] + file->compressed_size > archive->volume_limit))
+      {
+        volume = current[emptiest] = archive_new_volume(archive, emptiest);
+
+        used = (Count*)realloc(used, (archive->volumes_count + 1) * sizeof(Count));
+        used[volume] = 0;
+      }
+
+      if (archive->volume_limit > 0 && file->compressed_size > archive->volume_limit)
+      {
+        fprintf(stderr, "File `%s` is larger than the volume limit, it gets a volume of its own\n", file->name);
+      }
+    }
+    else
+    {
+      volume = 0;
+    }
+
+    file->volume = volume;
+    file->offset = used[volume];
+
+    used[volume] += file->compressed_size;
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+
+    if (file->reference == INDEX_NONE) continue;
+
+    file->volume = archive->files[file->reference]->volume;
+    file->offset = archive->files[file->reference]->offset;
+  }
+
+  free(current);
+  free(used);
+}
+
+/**
+ * Blocks are at least as large as the smallest block the options, the planner or the filters can pick
+ */
+static Count archive_kept_cost (Archive* archive, File* file)
+{
+  Count block = archive->block_size;
+
+  if (archive->plan   != PLAN_OFF    && (block == 0 || block > PLAN_BLOCK))       block = PLAN_BLOCK;
+  if (archive->filter != FILTER_NONE && (block == 0 || block > FILTER_FRAME / 8)) block = FILTER_FRAME / 8;
+
+  return KEPT_COST + (block > 0 ? (file->size / block + 1) * BLOCK_COST : 0);
+}
+
+/**
+ * What a member kept from scanning goes once it is written
+ */
+static void archive_forget (Archive* archive, File* file)
+{
+  if (file->tree) tree_release(file->tree);
+
+  free(file->histograms);
+
+  file->tree       = NULL;
+  file->histograms = NULL;
+
+  budget_drop(archive->budget, file->kept);
+
+  file->kept = 0;
+}
+
+/**
+ * What a scan needs next to its stream. The planner is done with its samples before any filter frame is used,
+ * and may pick a filter of its own
+ */
+static Count archive_scan_extra (Archive* archive)
+{
+  return archive->plan != PLAN_OFF ? PLAN_COST : FILTER_COST(archive->filter);
+}
+
+/**
+ * First pass over a member, the histogram and its encoded size. Unless streamed, the member keeps its tree
+ * until it is written and is charged for it up front, the most its blocks could take included. A member the
+ * budget has no room for is not scanned and returns nonzero, it is streamed at the end
+ */
+static int archive_scan (Archive* archive, File* file, int streamed)
+{
+  char* file_size;
+  char* file_compressed_size;
+  char filter[16];
+  int status;
+  Count cost;
+  Count charge;
+  double start = stats_clock();
+
+  file->sample     = archive->sample;
+  file->block_size = archive->block_size;
+  file->filter     = archive->filter;
+  file->plan       = archive->plan;
+
+  if (!streamed)
+  {
+    cost = archive_kept_cost(archive, file);
+
+    /**
+     * The size of the input stands in for the encoded size when placing the member
+     */
+    if (budget_keep(archive->budget, cost) != 0)
+    {
+      file->compressed_size = file->size;
+
+      return 1;
+    }
+
+    file->kept = cost;
+  }
+
+  charge = SCAN_COST(archive->budget) + archive_scan_extra(archive);
+
+  budget_acquire(archive->budget, charge);
+  status = file_open_read(file);
+  budget_release(archive->budget, charge);
+
+  profile_account(archive->profile, stats_clock() - start);
+
+  /**
+   * Only what was actually kept stays charged
+   */
+  if (file->kept > 0)
+  {
+    cost = KEPT_COST + (file->histograms ? file->blocks_count * BLOCK_COST : 0);
+
+    budget_drop(archive->budget, file->kept - cost);
+
+    file->kept = cost;
+  }
+
+  /**
+   * Copies may already refer to a member gone since it was measured, it stays in the archive as empty
+   */
+  if (status != 0)
+  {
+    file->size            = 0;
+    file->data_size       = 0;
+    file->compressed_size = 0;
+    file->sample          = 0;
+    file->mode            = CODER_RAW;
+
+    return 0;
+  }
+
+  if (file->sample) return 0;
+
+  file_size            = pretty_print_size(file->size);
+  file_compressed_size = pretty_print_size(file->compressed_size);
+
+  if (file->mode == CODER_RAW || file->filter != FILTER_NONE)
+  {
+    printf("File `%s` %s >> %s (%s)\n", file->name, file_size, file_compressed_size,
+           file->mode == CODER_RAW ? "raw" : filter_name(file->filter, filter, sizeof(filter)));
+  }
+  else
+  {
+    printf("File `%s` %s >> %s\n", file->name, file_size, file_compressed_size);
+  }
+
+  free(file_size);
+  free(file_compressed_size);
+
+  return 0;
+}
+
+/**
+ * Members stay where they were written. Sampled members that outgrew their estimate, and members the budget
+ * had no room to keep, are coded one after the other at the end of their volume. Sampled ones get room for
+ * every value having the longest code this time
+ */
+static void archive_settle (Archive* archive, int* backends, Count* ends, const int* outgrown, const int* streamed)
+{
+  Count i;
+
+  memset(ends, 0, (archive->volumes_count + 1) * sizeof(Count));
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+
+    if (file->reference != INDEX_NONE || outgrown[i] || streamed[i]) continue;
+
+    if (file->offset + file->compressed_size > ends[file->volume]) ends[file->volume] = file->offset + file->compressed_size;
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+
+    if (!outgrown[i] && !streamed[i]) continue;
+
+    if (streamed[i]) archive_scan(archive, file, 1);
+
+    file->offset = ends[file->volume];
+
+    if (file->sample) file->compressed_size = (file->tree->bit_count + file->data_size * file->tree->longest + 7) / 8;
+
+    ftruncate(backends[file->volume], archive->budget->window * ((file->offset + file->compressed_size + archive->budget->window - 1) / archive->budget->window));
+
+    budget_acquire(archive->budget, STREAM_COST(archive->budget) + FILTER_COST(file->filter));
+    file_write(file, backends[file->volume]);
+    budget_release(archive->budget, STREAM_COST(archive->budget) + FILTER_COST(file->filter));
+
+    archive_forget(archive, file);
+
+    ends[file->volume] += file->compressed_size;
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+
+    if (file->reference != INDEX_NONE)
+    {
+      file->offset = archive->files[file->reference]->offset;
+
+      continue;
+    }
+
+    if (file->sample)
+    {
+      char* file_size            = pretty_print_size(file->size);
+      char* file_compressed_size = pretty_print_size(file->compressed_size);
+
+      printf("File `%s` %s >> %s (sampled)\n", file->name, file_size, file_compressed_size);
+
+      free(file_size);
+      free(file_compressed_size);
+    }
+  }
+}
+
+/**
+ * Every subdirectory is walked by its own task, regular files are only added. Symbolic links and special
+ * files are skipped
+ */
+static void archive_walk (Archive* archive, const char* path, Count base)
+{
+  Count length = strlen(path);
+  Byte* buffer;
+  long read;
+  int directory = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (directory < 0)
+  {
+    fprintf(stderr, "Directory `%s` can not be read\n", path);
+
+    return;
+  }
+
+  buffer = (Byte*)malloc(WALK_BUFFER);
+
+  while ((read = getdents64(directory, buffer, WALK_BUFFER)) > 0)
+  {
+    long position;
+
+    for (position = 0; position < read; position += ((struct dirent64*)(buffer + position))->d_reclen)
+    {
+      struct dirent64* entry = (struct dirent64*)(buffer + position);
+      unsigned char type     = entry->d_type;
+      char* child;
+      File* file;
+
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+      if (type == DT_UNKNOWN)
+      {
+        struct statx status;
+
+        if (statx(directory, entry->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &status) != 0) continue;
+
+        type = S_ISDIR(status.stx_mode) ? DT_DIR : S_ISREG(status.stx_mode) ? DT_REG : DT_UNKNOWN;
+      }
+
+      if (type != DT_DIR && type != DT_REG) continue;
+
+      child = (char*)malloc(length + strlen(entry->d_name) + 2);
+      sprintf(child, length > 0 && path[length - 1] == '/' ? "%s%s" : "%s/%s", path, entry->d_name);
+
+      if (type == DT_DIR)
+      {
+        #pragma omp task firstprivate(child)
+        {
+          archive_walk(archive, child, base);
+          free(child);
+        }
+
+        continue;
+      }
+
+      file       = archive_add_file(archive, child);
+      file->base = base;
+
+      free(child);
+    }
+  }
+
+  free(buffer);
+  close(directory);
+}
+
+/**
+ * Members found in a directory are stored under the directory's own name, or below it for `.` and `..`
+ */
+static Count archive_directory_base (const char* directory)
+{
+  Count length = strlen(directory);
+  const char* name;
+
+  while (length > 1 && directory[length - 1] == '/') --length;
+
+  for (name = directory + length; name > directory && name[-1] != '/'; --name);
+
+  if ((directory + length - name == 1 && name[0] == '.') || (directory + length - name == 2 && name[0] == '.' && name[1] == '.'))
+  {
+    return strlen(directory) + (directory[strlen(directory) - 1] == '/' ? 0 : 1);
+  }
+
+  if (length == 1 && directory[0] == '/') return 1;
+
+  return name - directory;
+}
+
+/**
+ * Members coded in blocks are worth one stream per run of blocks
+ */
+static Count archive_units (Archive* archive)
+{
+  Count i;
+  Count units = 0;
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    units += archive->files[i]->blocks_count > 1 ? archive->files[i]->blocks_count : 1;
+  }
+
+  return units;
+}
+
+/**
+ * The most filter frames any member is coded through
+ */
+static Count archive_frames (Archive* archive)
+{
+  Count i;
+  Count frames = 0;
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    if (FILTER_COST(archive->files[i]->filter) > frames) frames = FILTER_COST(archive->files[i]->filter);
+  }
+
+  return frames;
+}
+
+static int compare_files (const void* first, const void* second)
+{
+  return strcmp((*(File* const*)first)->name, (*(File* const*)second)->name);
+}
+
+/**
+ * Sizes come first, they are all deduplication needs to start with. Members that can not be opened
+ * are left out of the archive
+ */
+static void archive_measure (Archive* archive)
+{
+  Count i;
+  Count kept = 0;
+
+  #pragma omp parallel for schedule(dynamic) num_threads(archive->budget->streams)
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+    struct stat status;
+    int input = open(file->name, O_RDONLY | O_CLOEXEC);
+
+    if (input < 0 || fstat(input, &status) != 0)
+    {
+      perror(file->name);
+
+      file->offset = INDEX_NONE;
+    }
+    else
+    {
+      file->size = status.st_size;
+    }
+
+    if (input >= 0) close(input);
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    if (archive->files[i]->offset == INDEX_NONE)
+    {
+      file_delete(archive->files[i]);
+
+      continue;
+    }
+
+    archive->files[kept++] = archive->files[i];
+  }
+
+  archive->files_count = kept;
+}
+
+void archive_compress (Archive* archive)
+{
+  Count i;
+  Count* ends;
+  int* backends;
+  int* outgrown;
+  int* streamed;
+  Count explicit       = archive->files_count;
+  int backend          = open(archive->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  double wall          = stats_clock();
+
+  budget_plan(archive->budget, 0, 0);
+
+  #pragma omp parallel num_threads(archive->budget->streams)
+  #pragma omp single
+  {
+    for (i = 0; i < archive->directories_count; ++i)
+    {
+      const char* directory = archive->directories[i];
+
+      #pragma omp task firstprivate(directory)
+      archive_walk(archive, directory, archive_directory_base(directory));
+    }
+  }
+
+  /**
+   * Walks finish in any order, sorting keeps the archive reproducible
+   */
+  qsort(archive->files + explicit, archive->files_count - explicit, sizeof(File*), compare_files);
+
+  archive_measure(archive);
+
+  archive_deduplicate(archive);
+
+  /**
+   * Copies are known before any histogram is built, only the members they refer to are scanned
+   */
+  budget_plan(archive->budget, archive->files_count, archive_scan_extra(archive));
+
+  streamed = (int*)calloc(archive->files_count, sizeof(int));
+
+  #pragma omp parallel for schedule(dynamic) num_threads(archive->budget->streams)
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    if (archive->files[i]->reference == INDEX_NONE) streamed[i] = archive_scan(archive, archive->files[i], 0);
+  }
+
+  archive_place(archive);
+
+  backends = archive_open_volumes(archive->name, backend, (const char**)archive->volumes, archive->volumes_count, O_RDWR | O_CREAT | O_TRUNC);
+
+  if (backends == NULL)
+  {
+    close(backend);
+
+    return;
+  }
+
+  ends = (Count*)calloc(archive->volumes_count + 1, sizeof(Count));
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+
+    if (file->offset + file->compressed_size > ends[file->volume]) ends[file->volume] = file->offset + file->compressed_size;
+  }
+
+  budget_plan(archive->budget, archive_units(archive), archive_frames(archive));
+
+  /**
+   * Stretch
+   */
+  for (i = 0; i <= archive->volumes_count; ++i)
+  {
+    ftruncate(backends[i], archive->budget->window * ((ends[i] + archive->budget->window - 1) / archive->budget->window));
+  }
+
+  outgrown = (int*)calloc(archive->files_count, sizeof(int));
+
+  /**
+   * Members in different volumes are written by different workers at the same time
+   */
+  #pragma omp parallel for num_threads(archive->budget->streams)
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file   = archive->files[i];
+    double start = stats_clock();
+
+    if (file->reference != INDEX_NONE || streamed[i]) continue;
+
+    budget_acquire(archive->budget, STREAM_COST(archive->budget) + FILTER_COST(file->filter));
+    outgrown[i] = file_write(file, backends[file->volume]) != 0;
+    budget_release(archive->budget, STREAM_COST(archive->budget) + FILTER_COST(file->filter));
+
+    if (!outgrown[i]) archive_forget(archive, file);
+
+    profile_account(archive->profile, stats_clock() - start);
+  }
+
+  archive_settle(archive, backends, ends, outgrown, streamed);
+
+  free(outgrown);
+  free(streamed);
+
+  for (i = 1; i <= archive->volumes_count; ++i)
+  {
+    ftruncate(backends[i], ends[i]);
+  }
+
+  /**
+   * Write index
+   */
+  archive_write_index(archive, backend, ends[0]);
+
+  archive_close_volumes(backends, archive->volumes_count);
+  free(ends);
+
+  close(backend);
+
+  if (archive->profile)
+  {
+    archive->profile->wall += stats_clock() - wall;
+
+    archive_report(archive);
+  }
+}
+
+/**
+ * Requested members sharing the same encoded data are decoded once, the rest of each group
+ * refers to the decoded member within the archive and is copied from it afterwards
+ */
+static void archive_group_copies (Archive* archive)
+{
+  Count i;
+  Count j;
+  Count count = 0;
+  Fingerprint* fingerprints = (Fingerprint*)malloc(archive->files_count * sizeof(Fingerprint));
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    if (archive->files[i]->offset == INDEX_NONE) continue;
+
+    fingerprints[count].size     = 0;
+    fingerprints[count].hash     = archive->files[i]->hash;
+    fingerprints[count].position = i;
+
+    ++count;
+  }
+
+  qsort(fingerprints, count, sizeof(Fingerprint), compare_fingerprints);
+
+  for (i = 0; i < count; i = j)
+  {
+    for (j = i + 1; j < count && fingerprints[j].hash == fingerprints[i].hash; ++j)
+    {
+      archive->files[fingerprints[j].position]->reference = fingerprints[i].position;
+    }
+  }
+
+  free(fingerprints);
+}
+
+int archive_decompress (Archive* archive)
+{
+  Count i;
+  int status  = 0;
+  int backend = open(archive->name, O_RDONLY);
+  double wall = stats_clock();
+  int* backends;
+  const char** volumes;
+  Count volumes_count;
+  Index* index;
+
+  index = backend < 0 ? NULL : index_open(backend);
+
+  if (index == NULL)
+  {
+    fprintf(stderr, "Archive `%s` is missing or not a bnc archive\n", archive->name);
+
+    if (backend >= 0) close(backend);
+
+    return -1;
+  }
+
+  volumes  = archive_index_volumes(index);
+  backends = volumes ? archive_open_volumes(archive->name, backend, volumes, index->volumes_count, O_RDONLY) : NULL;
+
+  if (volumes == NULL) fprintf(stderr, "Archive `%s` names a volume outside its index\n", archive->name);
+  if (backends)        index_bound_volumes(index, backends);
+
+  free(volumes);
+
+  if (backends == NULL)
+  {
+    index_close(index);
+    close(backend);
+
+    return -1;
+  }
+
+  volumes_count = index->volumes_count;
+
+  /**
+   * Without explicit members extract everything
+   */
+  if (archive->files_count == 0)
+  {
+    for (i = 0; i < index->count; ++i)
+    {
+      const char* name = index_name(index, i);
+
+      if (name == NULL)
+      {
+        fprintf(stderr, "Entry %zu of `%s` is corrupt\n", i, archive->name);
+
+        status = -1;
+
+        continue;
+      }
+
+      archive_add_file(archive, name);
+    }
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file     = archive->files[i];
+    Count position = index_find(index, file->name);
+    IndexEntry entry;
+    char* file_size;
+    char* file_compressed_size;
+
+    if (position == INDEX_NONE)
+    {
+      fprintf(stderr, "File `%s` not found in `%s`\n", file->name, archive->name);
+
+      file->offset = INDEX_NONE;
+      status       = -1;
+
+      continue;
+    }
+
+    if (!file_name_contained(file->name))
+    {
+      fprintf(stderr, "File `%s` in `%s` would be extracted outside the current directory\n", file->name, archive->name);
+
+      file->offset = INDEX_NONE;
+      status       = -1;
+
+      continue;
+    }
+
+    if (index_entry(index, position, &entry) != 0)
+    {
+      fprintf(stderr, "File `%s` in `%s` is corrupt\n", file->name, archive->name);
+
+      file->offset = INDEX_NONE;
+      status       = -1;
+
+      continue;
+    }
+
+    file->size            = entry.size;
+    file->compressed_size = entry.compressed_size;
+    file->offset          = entry.offset;
+    file->volume          = entry.volume;
+    file->hash            = entry.reference != INDEX_NONE ? entry.reference : position;
+    file->holes_count     = entry.holes_count;
+    file->holes           = (Count*)realloc(file->holes, 2 * entry.holes_count * sizeof(Count) + 1);
+
+    index_holes(index, &entry, file->holes);
+
+    file->blocks_count = entry.blocks_count;
+    file->blocks       = (Count*)realloc(file->blocks, 2 * entry.blocks_count * sizeof(Count) + 1);
+
+    index_blocks(index, &entry, file->blocks);
+
+    file->filter = entry.filter;
+    file->mode   = entry.mode;
+
+    file_size            = pretty_print_size(file->size);
+    file_compressed_size = pretty_print_size(file->compressed_size);
+
+    printf("File `%s` %s >> %s\n", file->name, file_size, file_compressed_size);
+
+    free(file_size);
+    free(file_compressed_size);
+  }
+
+  index_close(index);
+
+  archive_group_copies(archive);
+
+  budget_plan(archive->budget, archive_units(archive), archive_frames(archive));
+
+  /**
+   * Volumes are read concurrently, each member from its own
+   */
+  #pragma omp parallel for num_threads(archive->budget->streams)
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    double start = stats_clock();
+
+    if (archive->files[i]->offset == INDEX_NONE || archive->files[i]->reference != INDEX_NONE) continue;
+
+    budget_acquire(archive->budget, STREAM_COST(archive->budget) + FILTER_COST(archive->files[i]->filter));
+    file_open_write(archive->files[i]);
+    file_read(archive->files[i], backends[archive->files[i]->volume]);
+    budget_release(archive->budget, STREAM_COST(archive->budget) + FILTER_COST(archive->files[i]->filter));
+
+    profile_account(archive->profile, stats_clock() - start);
+  }
+
+  #pragma omp parallel for num_threads(archive->budget->streams)
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file   = archive->files[i];
+    double start = stats_clock();
+
+    if (file->offset == INDEX_NONE || file->reference == INDEX_NONE) continue;
+
+    if (file_copy(archive->files[file->reference], file) != 0)
+    {
+      #pragma omp atomic write
+      status = -1;
+    }
+
+    profile_account(archive->profile, stats_clock() - start);
+  }
+
+  archive_close_volumes(backends, volumes_count);
+  close(backend);
+
+  if (archive->profile)
+  {
+    archive->profile->wall += stats_clock() - wall;
+
+    archive_report(archive);
+  }
+
+  return status;
+}
+
+int archive_list (Archive* archive)
+{
+  Count i;
+  int describe;
+  int status  = 0;
+  int backend = open(archive->name, O_RDONLY);
+  Index* index;
+
+  index = backend < 0 ? NULL : index_open(backend);
+
+  if (index == NULL)
+  {
+    fprintf(stderr, "Archive `%s` is missing or not a bnc archive\n", archive->name);
+
+    if (backend >= 0) close(backend);
+
+    return -1;
+  }
+
+  /**
+   * Without explicit members the archive's files describe every member listed, as after extracting
+   */
+  describe = archive->files_count == 0;
+
+  for (i = 0; i < index->count; ++i)
+  {
+    IndexEntry entry;
+    char* file_size;
+    char* file_compressed_size;
+    char filter[16];
+    const char* name;
+
+    if (index_entry(index, i, &entry) != 0 || (name = index_name(index, i)) == NULL)
+    {
+      fprintf(stderr, "Entry %zu of `%s` is corrupt\n", i, archive->name);
+
+      status = -1;
+
+      continue;
+    }
+
+    if (describe)
+    {
+      File* file = archive_add_file(archive, name);
+
+      file->size            = entry.size;
+      file->compressed_size = entry.compressed_size;
+      file->offset          = entry.offset;
+      file->reference       = entry.reference;
+    }
+
+    file_size            = pretty_print_size(entry.size);
+    file_compressed_size = pretty_print_size(entry.compressed_size);
+
+    if (entry.mode == CODER_RAW || entry.filter != FILTER_NONE)
+    {
+      printf("File `%s` %s >> %s (%s)\n", name, file_size, file_compressed_size,
+             entry.mode == CODER_RAW ? "raw" : filter_name(entry.filter, filter, sizeof(filter)));
+    }
+    else
+    {
+      printf("File `%s` %s >> %s\n", name, file_size, file_compressed_size);
+    }
+
+    free(file_size);
+    free(file_compressed_size);
+  }
+
+  index_close(index);
+  close(backend);
+
+  return status;
+}
+
+void archive_delete (Archive* archive)
+{
+  Count i;
+
+  /**
+   * Serially, trees of members go to the spares of the calling thread and not to those of workers that may never
+   * run again
+   */
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    file_delete(archive->files[i]);
+  }
+
+  for (i = 0; i < archive->directories_count; ++i)
+  {
+    free(archive->directories[i]);
+  }
+
+  for (i = 0; i < archive->targets_count; ++i)
+  {
+    free(archive->targets[i]);
+  }
+
+  for (i = 0; i < archive->volumes_count; ++i)
+  {
+    free(archive->volumes[i]);
+  }
+
+  free(archive->targets);
+  free(archive->volumes);
+  free(archive->directories);
+  free(archive->files);
+  free(archive->name);
+  free(archive);
+}
+
+Batch* batch_new (const Count limit, const StatsFormat format)
+{
+  Batch* batch = (Batch*)calloc(1, sizeof(Batch));
+
+  batch->profile = profile_new(format);
+  batch->limit   = limit;
+  batch->filter  = FILTER_NONE;
+  batch->plan    = PLAN_OFF;
+
+  return batch;
+}
+
+/**
+ * The whole manifest is read before anything runs, a malformed line fails the batch
+ */
+int batch_read (Batch* batch, FILE* manifest)
+{
+  char* line    = NULL;
+  size_t size   = 0;
+  Count number  = 0;
+  int status    = 0;
+
+  while (getline(&line, &size, manifest) != -1)
+  {
+    Job* job;
+    char* field;
+    char* state;
+
+    ++number;
+
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (line[0] == '\0' || line[0] == '#') continue;
+
+    batch->jobs = (Job*)realloc(batch->jobs, (batch->jobs_count + 1) * sizeof(Job));
+    job         = &batch->jobs[batch->jobs_count++];
+
+    memset(job, 0, sizeof(Job));
+
+    job->line = number;
+
+    for (field = strtok_r(line, "\t", &state); field; field = strtok_r(NULL, "\t", &state))
+    {
+      if (job->op == '\0')
+      {
+        job->op = strlen(field) == 1 ? field[0] : '?';
+      }
+      else if (job->archive == NULL)
+      {
+        job->archive = strdup(field);
+      }
+      else
+      {
+        job->paths = (char**)realloc(job->paths, (job->paths_count + 1) * sizeof(char*));
+        job->paths[job->paths_count++] = strdup(field);
+      }
+    }
+
+    if (job->archive == NULL || (job->op != 'b' && job->op != 'u' && job->op != 'l') ||
+        (job->op == 'b' && job->paths_count == 0) || (job->op == 'l' && job->paths_count > 0))
+    {
+      fprintf(stderr, "Manifest line %zu is not a b, u or l job with an archive\n", number);
+
+      status = -1;
+    }
+  }
+
+  free(line);
+
+  return status;
+}
+
+typedef struct JobKey JobKey;
+
+struct JobKey
+{
+  Job*  job;
+  char* path;
+};
+
+/**
+ * The absolute path of an archive, through its directory when it does not exist yet, so that every
+ * spelling of the same archive compares equal
+ */
+static char* batch_archive_path (const char* archive)
+{
+  const char* separator = strrchr(archive, '/');
+  const char* base      = separator ? separator + 1 : archive;
+  char* directory;
+  char* resolved;
+  char* path = realpath(archive, NULL);
+
+  if (path) return path;
+
+  directory = separator == NULL ? strdup(".") : separator == archive ? strdup("/") : strndup(archive, separator - archive);
+  resolved  = realpath(directory, NULL);
+
+  free(directory);
+
+  if (resolved == NULL) return strdup(archive);
+
+  path = (char*)malloc(strlen(resolved) + strlen(base) + 2);
+  sprintf(path, "%s/%s", resolved, base);
+
+  free(resolved);
+
+  return path;
+}
+
+static int compare_jobs (const void* first, const void* second)
+{
+  const JobKey* a = (const JobKey*)first;
+  const JobKey* b = (const JobKey*)second;
+  int order       = strcmp(a->path, b->path);
+
+  return order != 0 ? order : (a->job->line > b->job->line) - (a->job->line < b->job->line);
+}
+
+/**
+ * Jobs on the same archive share the key of the first of them
+ */
+static void batch_keys (Batch* batch)
+{
+  Count i;
+  JobKey* keys = (JobKey*)malloc(batch->jobs_count * sizeof(JobKey) + 1);
+
+  for (i = 0; i < batch->jobs_count; ++i)
+  {
+    keys[i].job  = &batch->jobs[i];
+    keys[i].path = batch_archive_path(batch->jobs[i].archive);
+  }
+
+  qsort(keys, batch->jobs_count, sizeof(JobKey), compare_jobs);
+
+  for (i = 0; i < batch->jobs_count; ++i)
+  {
+    keys[i].job->key = i > 0 && strcmp(keys[i].path, keys[i - 1].path) == 0 ? keys[i - 1].job->key : (Count)(keys[i].job - batch->jobs);
+  }
+
+  for (i = 0; i < batch->jobs_count; ++i)
+  {
+    free(keys[i].path);
+  }
+
+  free(keys);
+}
+
+static void batch_job (Batch* batch, Job* job, Budget* budget)
+{
+  Count i;
+  double start     = stats_clock();
+  Archive* archive = archive_new(job->archive, budget);
+
+  archive->sample       = batch->sample;
+  archive->block_size   = batch->block_size;
+  archive->filter       = batch->filter;
+  archive->plan         = batch->plan;
+  archive->volume_limit = batch->volume_limit;
+
+  for (i = 0; i < batch->targets_count; ++i)
+  {
+    archive_add_target(archive, batch->targets[i]);
+  }
+
+  for (i = 0; i < job->paths_count; ++i)
+  {
+    struct stat status;
+
+    if (job->op != 'b')
+    {
+      archive_add_file(archive, job->paths[i]);
+    }
+    else if (stat(job->paths[i], &status) != 0)
+    {
+      fprintf(stderr, "File `%s` is missing\n", job->paths[i]);
+
+      job->status = -1;
+    }
+    else if (S_ISDIR(status.st_mode))
+    {
+      archive_add_directory(archive, job->paths[i]);
+    }
+    else
+    {
+      archive_add_file(archive, job->paths[i]);
+    }
+  }
+
+  if (job->status == 0)
+  {
+    switch (job->op)
+    {
+      case 'b':               archive_compress(archive);   break;
+      case 'u': job->status = archive_decompress(archive); break;
+      case 'l': job->status = archive_list(archive);       break;
+    }
+  }
+
+  for (i = 0; i < archive->files_count; ++i)
+  {
+    File* file = archive->files[i];
+
+    if (job->op == 'u' && file->offset == INDEX_NONE) continue;
+
+    ++job->members;
+
+    job->size += file->size;
+
+    if (file->reference == INDEX_NONE) job->compressed_size += file->compressed_size;
+  }
+
+  archive_delete(archive);
+
+  job->seconds = stats_clock() - start;
+
+  profile_account(batch->profile, job->seconds);
+}
+
+/**
+ * One team for the whole batch, every job is a task and the parallel regions inside a job are not nested
+ * into teams of their own. Threads free their spare trees and buffers once the last job is done.
+ *
+ * Workers split the budget evenly, less what their spares may hold, and every job runs within the share of
+ * the worker it lands on. Fewer workers run when a share would not hold a single stream
+ */
+int batch_run (Batch* batch)
+{
+  Count i;
+  Count share;
+  Count threads = batch->profile->threads;
+  int status    = 0;
+  double wall   = stats_clock();
+  Byte* keys    = (Byte*)calloc(batch->jobs_count + 1, 1);
+  Budget** budgets;
+
+  if (batch->limit > 0 && threads * (STREAM_MINIMUM + SPARES_COST) > batch->limit)
+  {
+    threads = batch->limit / (STREAM_MINIMUM + SPARES_COST) > 0 ? batch->limit / (STREAM_MINIMUM + SPARES_COST) : 1;
+  }
+
+  share = batch->limit / threads;
+
+  if (batch->limit > 0) share = share > SPARES_COST ? share - SPARES_COST : 1;
+
+  budgets = (Budget**)malloc(threads * sizeof(Budget*));
+
+  for (i = 0; i < threads; ++i)
+  {
+    budgets[i] = budget_new(share);
+  }
+
+  batch->profile->threads = threads;
+
+  batch_keys(batch);
+
+  omp_set_max_active_levels(1);
+
+  #pragma omp parallel num_threads(threads)
+  {
+    #pragma omp single
+    {
+      for (i = 0; i < batch->jobs_count; ++i)
+      {
+        Job* job = &batch->jobs[i];
+
+        #pragma omp task firstprivate(job) depend(inout: keys[job->key])
+        batch_job(batch, job, budgets[omp_get_thread_num()]);
+      }
+    }
+
+    spares_release();
+  }
+
+  batch->profile->wall += stats_clock() - wall;
+
+  for (i = 0; i < threads; ++i)
+  {
+    budget_delete(budgets[i]);
+  }
+
+  free(budgets);
+
+  for (i = 0; i < batch->jobs_count; ++i)
+  {
+    if (batch->jobs[i].status != 0) status = -1;
+  }
+
+  free(keys);
+
+  return status;
+}
+
+/**
+ * Per job results in manifest order and how busy each worker was, on stderr
+ */
+void batch_report (Batch* batch)
+{
+  Count i;
+  Count failed     = 0;
+  Profile* profile = batch->profile;
+
+  for (i = 0; i < batch->jobs_count; ++i)
+  {
+    Job* job = &batch->jobs[i];
+
+    if (job->status != 0) ++failed;
+
+    if (profile->format == STATS_JSON)
+    {
+      fprintf(stderr, "{\"job\":%zu,\"line\":%zu,\"op\":\"%c\",\"archive\":", i, job->line, job->op);
+      json_print_string(job->archive);
+      fprintf(stderr, ",\"status\":%d,\"members\":%zu,\"bytes\":%zu,\"compressed\":%zu,\"seconds\":%.6f}\n",
+              job->status, job->members, job->size, job->compressed_size, job->seconds);
+    }
+    else
+    {
+      char* size            = pretty_print_size(job->size);
+      char* compressed_size = pretty_print_size(job->compressed_size);
+
+      fprintf(stderr, "Job %zu %c `%s` %s, %zu members %s >> %s in %.6f s\n", i, job->op, job->archive,
+              job->status == 0 ? "done" : "failed", job->members, size, compressed_size, job->seconds);
+
+      free(size);
+      free(compressed_size);
+    }
+  }
+
+  if (profile->format == STATS_JSON)
+  {
+    fprintf(stderr, "{\"jobs\":%zu,\"failed\":%zu,\"wall\":%.6f,\"threads\":[", batch->jobs_count, failed, profile->wall);
+
+    for (i = 0; i < profile->threads; ++i)
+    {
+      fprintf(stderr, "%s{\"busy\":%.6f,\"utilisation\":%.4f}", i ? "," : "", profile->busy[i],
+              profile->wall > 0 ? profile->busy[i] / profile->wall : 0);
+    }
+
+    fprintf(stderr, "]}\n");
+
+    return;
+  }
+
+  fprintf(stderr, "Jobs %zu, %zu failed, wall %.6f s\n", batch->jobs_count, failed, profile->wall);
+
+  for (i = 0; i < profile->threads; ++i)
+  {
+    fprintf(stderr, "  thread %zu %10.6f s busy, %5.1f%% utilised\n", i, profile->busy[i],
+            profile->wall > 0 ? 100 * profile->busy[i] / profile->wall : 0);
+  }
+}
+
+void batch_delete (Batch* batch)
+{
+  Count i;
+  Count j;
+
+  for (i = 0; i < batch->jobs_count; ++i)
+  {
+    for (j = 0; j < batch->jobs[i].paths_count; ++j)
+    {
+      free(batch->jobs[i].paths[j]);
+    }
+
+    free(batch->jobs[i].paths);
+    free(batch->jobs[i].archive);
+  }
+
+  free(batch->jobs);
+  profile_delete(batch->profile);
+  free(batch);
+}
+
+#define SERVER_BUCKETS ((Count)1 << 12)
+#define SERVER_LINE    4096
+
+typedef struct Connection Connection;
+
+struct Connection
+{
+  Server* server;
+  int     socket;
+};
+
+Server* server_new (Budget* budget, Count cache_limit)
+{
+  Server* server = (Server*)malloc(sizeof(Server));
+
+  pthread_mutex_init(&server->lock, NULL);
+
+  server->budget   = budget;
+  server->archives = NULL;
+
+  server->buckets = (CachedBlock**)calloc(SERVER_BUCKETS, sizeof(CachedBlock*));
+  server->newest  = NULL;
+  server->oldest  = NULL;
+
+  server->cache_size  = 0;
+  server->cache_limit = cache_limit;
+  server->hits        = 0;
+  server->misses      = 0;
+
+  budget_plan(budget, 1, 0);
+
+  return server;
+}
+
+static Count server_hash (ServedMember* member, Count block)
+{
+  return (((Count)member >> 4) * HASH_PRIME ^ block) & (SERVER_BUCKETS - 1);
+}
+
+static Count server_modified (struct stat* status)
+{
+  return (Count)status->st_mtim.tv_sec * 1000000000 + status->st_mtim.tv_nsec;
+}
+
+/**
+ * Both the open archive and whatever the name refers to now have to be the archive that was opened
+ */
+static int server_current (ServedArchive* archive)
+{
+  struct stat status;
+
+  if (fstat(archive->backends[0], &status) != 0 || status.st_ino != archive->inode ||
+      (Count)status.st_size != archive->size || server_modified(&status) != archive->modified)
+  {
+    return 0;
+  }
+
+  if (stat(archive->name, &status) != 0 || status.st_ino != archive->inode ||
+      (Count)status.st_size != archive->size || server_modified(&status) != archive->modified)
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Callers hold the server lock
+ */
+static void server_remove (Server* server, CachedBlock* cached)
+{
+  CachedBlock** link = &server->buckets[server_hash(cached->member, cached->block)];
+
+  while (*link != cached) link = &(*link)->chained;
+
+  *link = cached->chained;
+
+  if (cached->older) cached->older->newer = cached->newer;
+  else               server->oldest       = cached->newer;
+
+  if (cached->newer) cached->newer->older = cached->older;
+  else               server->newest       = cached->older;
+
+  server->cache_size -= cached->size;
+
+  free(cached->bytes);
+  free(cached);
+}
+
+/**
+ * Callers hold the server lock, the blocks of its members leave the cache with the archive
+ */
+static void server_drop (Server* server, ServedArchive* archive)
+{
+  Count i;
+  CachedBlock* cached = server->oldest;
+
+  while (cached)
+  {
+    CachedBlock* newer = cached->newer;
+
+    if (cached->member >= archive->members && cached->member < archive->members + archive->index->count)
+    {
+      server_remove(server, cached);
+    }
+
+    cached = newer;
+  }
+
+  for (i = 0; i < archive->index->count; ++i)
+  {
+    ServedMember* member = &archive->members[i];
+
+    if (member->tree) tree_delete(member->tree);
+
+    free(member->holes);
+    free(member->blocks);
+    free(member->checkpoints);
+    pthread_mutex_destroy(&member->lock);
+  }
+
+  close(archive->backends[0]);
+  archive_close_volumes(archive->backends, archive->index->volumes_count);
+  index_close(archive->index);
+
+  free(archive->members);
+  free(archive->name);
+  free(archive);
+}
+
+/**
+ * Archives are opened on first use and stay open, with their index mapped, until the server exits or they
+ * change on disk. Every archive returned has to be given back with server_release
+ */
+static ServedArchive* server_archive (Server* server, const char* name)
+{
+  ServedArchive* archive;
+  ServedArchive** link;
+  Count i;
+
+  pthread_mutex_lock(&server->lock);
+
+  for (link = &server->archives; *link; link = &(*link)->next)
+  {
+    if (strcmp((*link)->name, name) == 0) break;
+  }
+
+  archive = *link;
+
+  /**
+   * A stale archive leaves the list at once, and goes away when its last user is done with it
+   */
+  if (archive && !server_current(archive))
+  {
+    *link = archive->next;
+
+    if (archive->users == 0) server_drop(server, archive);
+    else                     archive->stale = 1;
+
+    archive = NULL;
+  }
+
+  if (archive == NULL)
+  {
+    int backend  = open(name, O_RDONLY | O_CLOEXEC);
+    Index* index = backend < 0 ? NULL : index_open(backend);
+    int* backends = NULL;
+    struct stat status;
+
+    if (index != NULL)
+    {
+      const char** volumes = archive_index_volumes(index);
+
+      backends = volumes ? archive_open_volumes(name, backend, volumes, index->volumes_count, O_RDONLY) : NULL;
+
+      if (backends) index_bound_volumes(index, backends);
+
+      free(volumes);
+
+      if (backends == NULL) index_close(index);
+    }
+
+    if (backends != NULL && fstat(backend, &status) != 0)
+    {
+      archive_close_volumes(backends, index->volumes_count);
+      index_close(index);
+
+      backends = NULL;
+    }
+
+    if (backends != NULL)
+    {
+      archive = (ServedArchive*)malloc(sizeof(ServedArchive));
+
+      archive->name     = strdup(name);
+      archive->backends = backends;
+      archive->index    = index;
+      archive->inode    = status.st_ino;
+      archive->size     = status.st_size;
+      archive->modified = server_modified(&status);
+      archive->users    = 0;
+      archive->stale    = 0;
+      archive->members  = (ServedMember*)calloc(index->count, sizeof(ServedMember));
+      archive->next     = server->archives;
+
+      for (i = 0; i < index->count; ++i)
+      {
+        pthread_mutex_init(&archive->members[i].lock, NULL);
+      }
+
+      server->archives = archive;
+    }
+    else if (backend >= 0)
+    {
+      close(backend);
+    }
+  }
+
+  if (archive) ++archive->users;
+
+  pthread_mutex_unlock(&server->lock);
+
+  return archive;
+}
+
+static void server_release (Server* server, ServedArchive* archive)
+{
+  pthread_mutex_lock(&server->lock);
+
+  if (--archive->users == 0 && archive->stale) server_drop(server, archive);
+
+  pthread_mutex_unlock(&server->lock);
+}
+
+static Count server_stream_tell (BitStream* stream)
+{
+  return 8 * stream->window * (stream->offset / stream->window) + stream->count;
+}
+
+static BitStream* server_stream (ServedArchive* archive, ServedMember* member, Count bit, Count window)
+{
+  BitStream* stream = bit_stream_new(archive->backends[member->volume], PROT_READ, bit / 8, window);
+
+  stream->count += bit % 8;
+
+  return stream;
+}
+
+/**
+ * Members without runs of blocks are one run, the tree of the run last decoded stays loaded
+ */
+/**
+ * -1 when the member's entry is corrupt, the member then stays unprepared
+ */
+static int server_prepare (ServedArchive* archive, ServedMember* member, Count position)
+{
+  IndexEntry entry;
+  Count i;
+
+  if (index_entry(archive->index, position, &entry) != 0) return -1;
+
+  member->volume      = entry.volume;
+  member->offset      = entry.offset;
+  member->size        = entry.size;
+  member->data_size   = entry.size;
+  member->filter      = entry.filter;
+  member->mode        = entry.mode;
+  member->holes_count = entry.holes_count;
+  member->holes       = (Count*)malloc(2 * entry.holes_count * sizeof(Count) + 1);
+
+  index_holes(archive->index, &entry, member->holes);
+
+  for (i = 0; i < entry.holes_count; ++i)
+  {
+    member->data_size -= member->holes[2 * i + 1];
+  }
+
+  member->blocks_count = entry.blocks_count > 0 ? entry.blocks_count : 1;
+  member->blocks       = (Count*)malloc(2 * member->blocks_count * sizeof(Count));
+
+  if (entry.blocks_count > 0)
+  {
+    index_blocks(archive->index, &entry, member->blocks);
+  }
+  else
+  {
+    member->blocks[0] = member->data_size;
+    member->blocks[1] = 0;
+  }
+
+  member->tree   = tree_new();
+  member->loaded = INDEX_NONE;
+
+  member->checkpoints       = (Count*)malloc((member->data_size / SERVER_BLOCK + 2) * sizeof(Count));
+  member->checkpoints[0]    = 0;
+  member->checkpoints_count = 1;
+
+  return 0;
+}
+
+static BitStream* server_load_tree (Server* server, ServedArchive* archive, ServedMember* member, Count block)
+{
+  BitStream* stream = bit_stream_new(archive->backends[member->volume], PROT_READ, member->offset + member->blocks[2 * block + 1], server->budget->window);
+
+  tree_reset(member->tree);
+  tree_set_read_stream(member->tree, stream);
+
+  member->loaded = block;
+
+  return stream;
+}
+
+/**
+ * Position among the encoded bytes of a position within the member
+ */
+static Count server_data_position (ServedMember* member, Count position)
+{
+  Count i;
+  Count data = position;
+
+  for (i = 0; i < member->holes_count && member->holes[2 * i] < position; ++i)
   {
-    char* file_size;
-    char* file_compressed_size;
+    Count end = member->holes[2 * i] + member->holes[2 * i + 1];
+
+    data -= (end < position ? end : position) - member->holes[2 * i];
+  }
 
-    file_open_read(archive->files[i]);
+  return data;
+}
 
-    file_size            = pretty_print_size(archive->files[i]->size);
-    file_compressed_size = pretty_print_size(archive->files[i]->compressed_size);
+/**
+ * Continues at `bit` unless the data starts a run of blocks, which begins with its own tree
+ */
+static int server_decode_data (Server* server, ServedArchive* archive, ServedMember* member, BitStream** stream, Count bit, Count* data, Byte* bytes, Count length)
+{
+  int failed = 0;
 
-    printf("File `%s` %s >> %s\n", archive->files[i]->name, file_size, file_compressed_size);
+  while (length > 0)
+  {
+    Count block = 0;
+    Count start = 0;
+    Count count;
 
-    free(file_size);
-    free(file_compressed_size);
+    while (block + 1 < member->blocks_count && start + member->blocks[2 * block] <= *data)
+    {
+      start += member->blocks[2 * block];
+      ++block;
+    }
+
+    if (*data == start)
+    {
+      if (*stream)
+      {
+        failed |= (*stream)->failed;
+        bit_stream_delete(*stream);
+      }
+
+      *stream = server_load_tree(server, archive, member, block);
+    }
+    else if (*stream == NULL)
+    {
+      if (member->loaded != block)
+      {
+        BitStream* header = server_load_tree(server, archive, member, block);
+
+        failed |= header->failed;
+        bit_stream_delete(header);
+      }
+
+      *stream = server_stream(archive, member, bit, server->budget->window);
+    }
+
+    count = start + member->blocks[2 * block] - *data < length ? start + member->blocks[2 * block] - *data : length;
+
+    member->tree->stream = *stream;
+
+    tree_read_many(member->tree, bytes, count);
+
+    member->tree->stream = NULL;
+
+    bytes  += count;
+    length -= count;
+    *data  += count;
   }
 
-  for (i = 0; i < archive->files_count; ++i)
+  return failed;
+}
+
+/**
+ * Decodes one block of data starting at its checkpoint, the block being a whole frame of a filtered member
+ */
+static Byte* server_decode_block (Server* server, ServedArchive* archive, ServedMember* member, Count block, Count* size)
+{
+  Count start       = block * SERVER_BLOCK;
+  Count end         = start + SERVER_BLOCK < member->data_size ? start + SERVER_BLOCK : member->data_size;
+  Count data        = start;
+  Byte* bytes       = (Byte*)malloc(end - start + 1);
+  BitStream* stream = NULL;
+  int failed;
+
+  /**
+   * Stored members need neither checkpoints nor the blocks before
+   */
+  if (member->mode == CODER_RAW)
   {
-    archive->files[i]->offset = offset;
-    offset += archive->files[i]->compressed_size;
+    if (pread(archive->backends[member->volume], bytes, end - start, member->offset + start) != (ssize_t)(end - start))
+    {
+      free(bytes);
+
+      return NULL;
+    }
+
+    *size = end - start;
+
+    return bytes;
   }
 
+  failed = server_decode_data(server, archive, member, &stream, member->checkpoints[block], &data, bytes, end - start);
+
+  if (stream) failed |= stream->failed;
+
   /**
-   * Stretch
+   * A block that failed to decode leaves no checkpoint behind, the next attempt fails the same way
    */
-  aligned_offset = MAP_SIZE * ((offset + MAP_SIZE - 1) / MAP_SIZE);
-  ftruncate(backend, aligned_offset);
+  if (!failed && block + 1 == member->checkpoints_count)
+  {
+    member->checkpoints[member->checkpoints_count++] = stream ? server_stream_tell(stream) : member->checkpoints[block];
+  }
 
-  #pragma omp parallel for
-  for (i = 0; i < archive->files_count; ++i)
+  if (stream) bit_stream_delete(stream);
+
+  if (failed)
   {
-    file_write(archive->files[i], backend);
+    free(bytes);
+
+    return NULL;
   }
 
-  /**
-   * Write head
-   */
-  ftruncate(backend, offset);
-  lseek(backend, 0, SEEK_END);
-  write(backend, &count, sizeof(Count));
+  if (member->filter != FILTER_NONE)
+  {
+    Byte* scratch = (Byte*)malloc(end - start + 1);
 
-  for (i = 0; i < archive->files_count; ++i)
+    filter_revert(member->filter, bytes, scratch, end - start);
+
+    free(scratch);
+  }
+
+  *size = end - start;
+
+  return bytes;
+}
+
+/**
+ * Callers hold the server lock, a hit becomes the most recently used block
+ */
+static CachedBlock* server_lookup (Server* server, ServedMember* member, Count block)
+{
+  CachedBlock* cached;
+
+  for (cached = server->buckets[server_hash(member, block)]; cached; cached = cached->chained)
+  {
+    if (cached->member == member && cached->block == block) break;
+  }
+
+  if (cached && cached != server->newest)
   {
-    char* name;
-    Count name_length;
-    Count size            = htonll(archive->files[i]->size);
-    Count compressed_size = htonll(archive->files[i]->compressed_size);
+    if (cached->older) cached->older->newer = cached->newer;
+    else               server->oldest       = cached->newer;
+
+    cached->newer->older = cached->older;
+
+    cached->older        = server->newest;
+    cached->newer        = NULL;
+    server->newest->newer = cached;
+    server->newest       = cached;
+  }
 
-    name        = strrchr(archive->files[i]->name, '/');
-    name        = name ? name + 1 : archive->files[i]->name;
-    name_length = strlen(name);
+  return cached;
+}
 
-    head_length += sizeof(Count) + name_length + 2 * sizeof(Count);
+/**
+ * Callers hold the server lock, the block is owned by the cache afterwards
+ */
+static void server_insert (Server* server, ServedMember* member, Count block, Byte* bytes, Count size)
+{
+  CachedBlock* cached;
+  Count hash = server_hash(member, block);
 
-    name_length = htonll(name_length);
+  if (size > server->cache_limit)
+  {
+    free(bytes);
 
-    write(backend, &name_length,     sizeof(Count));
-    write(backend, name,             strlen(name));
-    write(backend, &size,            sizeof(Count));
-    write(backend, &compressed_size, sizeof(Count));
+    return;
+  }
 
+  while (server->oldest && server->cache_size + size > server->cache_limit)
+  {
+    server_remove(server, server->oldest);
   }
-  head_length += 2 * sizeof(Count);
-  head_length = htonll(head_length);
 
-  write(backend, &head_length, sizeof(Count));
+  cached = (CachedBlock*)malloc(sizeof(CachedBlock));
 
-  close(backend);
+  cached->member  = member;
+  cached->block   = block;
+  cached->bytes   = bytes;
+  cached->size    = size;
+  cached->chained = server->buckets[hash];
+  cached->newer   = NULL;
+  cached->older   = server->newest;
+
+  if (server->newest) server->newest->newer = cached;
+  else                server->oldest        = cached;
+
+  server->buckets[hash] = cached;
+  server->newest        = cached;
+  server->cache_size   += size;
 }
 
-void archive_decompress (Archive* archive)
+/**
+ * Copies `length` bytes at `skip` within a block, decoding it and every block before it that
+ * has no checkpoint yet when it is not cached
+ */
+static int server_read_block (Server* server, ServedArchive* archive, ServedMember* member, Count block, Byte* destination, Count skip, Count length)
 {
-  Count i;
-  Count offset = 0;
-  Count count;
-  Count head_length;
-  int backend = open(archive->name, O_RDONLY);
+  CachedBlock* cached;
+  Count next;
+  int status = 0;
 
-  #pragma omp parallel for
-  for (i = 0; i < archive->files_count; ++i)
+  pthread_mutex_lock(&server->lock);
+
+  if ((cached = server_lookup(server, member, block)) != NULL)
   {
-    file_open_write(archive->files[i]);
+    memcpy(destination, cached->bytes + skip, length);
+    ++server->hits;
+  }
+  else
+  {
+    ++server->misses;
   }
 
-  /**
-   * Read head
-   */
-  lseek(backend, -sizeof(Count), SEEK_END);
-  read(backend, &head_length, sizeof(Count));
-  head_length = ntohll(head_length);
+  pthread_mutex_unlock(&server->lock);
 
-  lseek(backend, -head_length, SEEK_END);
-  read(backend, &count, sizeof(Count));
-  count = ntohll(count);
+  if (cached) return 0;
 
-  for (i = 0; i < count; ++i)
+  pthread_mutex_lock(&member->lock);
+
+  for (next = block < member->checkpoints_count - 1 || member->mode == CODER_RAW ? block : member->checkpoints_count - 1; next <= block; ++next)
   {
-    Count j;
-    Count name_length;
     Count size;
-    Count compressed_size;
-    char* file_size;
-    char* file_compressed_size;
-    char* name;
+    Byte* bytes;
 
-    read(backend, &name_length, sizeof(Count));
-    name_length = ntohll(name_length);
+    /**
+     * Another request may have decoded it while waiting for the member
+     */
+    if (next == block)
+    {
+      pthread_mutex_lock(&server->lock);
+      cached = server_lookup(server, member, block);
 
-    name = (char*)malloc((name_length + 1) * sizeof(char));
-    name[name_length] = '\0';
+      if (cached) memcpy(destination, cached->bytes + skip, length);
 
-    read(backend, name, name_length);
+      pthread_mutex_unlock(&server->lock);
 
-    read(backend, &size,            sizeof(Count));
-    read(backend, &compressed_size, sizeof(Count));
+      if (cached) break;
+    }
 
-    size            = ntohll(size);
-    compressed_size = ntohll(compressed_size);
+    bytes = server_decode_block(server, archive, member, next, &size);
 
-    file_size            = pretty_print_size(size);
-    file_compressed_size = pretty_print_size(compressed_size);
+    if (bytes == NULL)
+    {
+      status = -1;
 
-    printf("File `%s` %s >> %s\n", name, file_size, file_compressed_size);
+      break;
+    }
 
-    free(file_size);
-    free(file_compressed_size);
+    if (next == block) memcpy(destination, bytes + skip, length);
+
+    pthread_mutex_lock(&server->lock);
+
+    if (server_lookup(server, member, next) == NULL) server_insert(server, member, next, bytes, size);
+    else                                             free(bytes);
+
+    pthread_mutex_unlock(&server->lock);
+  }
+
+  pthread_mutex_unlock(&member->lock);
+
+  return status;
+}
+
+/**
+ * Answers `OK length` followed by the bytes, or `ERR message`
+ */
+static void server_serve (Server* server, FILE* output, Byte* buffer, const char* name, const char* member_name, Count offset, Count length)
+{
+  ServedArchive* archive = server_archive(server, name);
+  ServedMember* member;
+  IndexEntry entry;
+  Count position;
+  Count hole = 0;
+  int prepared;
+  int promised = 0;
+
+  if (archive == NULL)
+  {
+    fprintf(output, "ERR Archive `%s` is missing or not a bnc archive\n", name);
+
+    return;
+  }
+
+  position = index_find(archive->index, member_name);
 
-    for (j = 0; j < archive->files_count; ++j)
+  if (position == INDEX_NONE)
+  {
+    fprintf(output, "ERR File `%s` not found in `%s`\n", member_name, name);
+
+    server_release(server, archive);
+
+    return;
+  }
+
+  /**
+   * Copies share the blocks of the member they were deduplicated against
+   */
+  if (index_entry(archive->index, position, &entry) == 0 && entry.reference != INDEX_NONE) position = entry.reference;
+
+  member = &archive->members[position];
+
+  pthread_mutex_lock(&member->lock);
+
+  prepared = member->tree != NULL || server_prepare(archive, member, position) == 0;
+
+  pthread_mutex_unlock(&member->lock);
+
+  if (!prepared)
+  {
+    fprintf(output, "ERR File `%s` in `%s` is corrupt\n", member_name, name);
+
+    server_release(server, archive);
+
+    return;
+  }
+
+  if (offset > member->size)          offset = member->size;
+  if (length > member->size - offset) length = member->size - offset;
+
+  if (length == 0) fprintf(output, "OK 0\n");
+
+  while (length > 0)
+  {
+    Count count;
+
+    while (hole < member->holes_count && member->holes[2 * hole] + member->holes[2 * hole + 1] <= offset) ++hole;
+
+    if (hole < member->holes_count && member->holes[2 * hole] <= offset)
+    {
+      count = member->holes[2 * hole] + member->holes[2 * hole + 1] - offset;
+      count = count < length ? count : length;
+      count = count < SERVER_BLOCK ? count : SERVER_BLOCK;
+
+      memset(buffer, 0, count);
+    }
+    else
     {
-      if (strcmp(name, archive->files[j]->name) == 0)
+      Count limit = hole < member->holes_count ? member->holes[2 * hole] : member->size;
+      Count data  = server_data_position(member, offset);
+      Count skip  = data % SERVER_BLOCK;
+
+      count = limit - offset < length ? limit - offset : length;
+      count = count < SERVER_BLOCK - skip ? count : SERVER_BLOCK - skip;
+
+      /**
+       * Once the length is promised, a corrupt member ends the connection early
+       */
+      if (server_read_block(server, archive, member, data / SERVER_BLOCK, buffer, skip, count) != 0)
       {
-        archive->files[j]->size            = size;
-	archive->files[j]->compressed_size = compressed_size;
-        archive->files[j]->offset          = offset;
+        if (!promised) fprintf(output, "ERR File `%s` in `%s` is corrupt\n", member_name, name);
+
+        break;
       }
     }
 
-    free(name);
+    /**
+     * The first piece is in hand before the length is promised, so a member that is corrupt from its start
+     * gets an error instead
+     */
+    if (!promised) fprintf(output, "OK %zu\n", length);
 
-    offset += compressed_size;
+    promised = 1;
+
+    if (fwrite(buffer, 1, count, output) != count) break;
+
+    offset += count;
+    length -= count;
   }
 
-  #pragma omp parallel for
-  for (i = 0; i < archive->files_count; ++i)
+  server_release(server, archive);
+}
+
+/**
+ * One request per line, fields separated by tabs:
+ *   GET archive member [offset [length]]
+ *   STATS
+ */
+static void* server_connection (void* argument)
+{
+  Connection* connection = (Connection*)argument;
+  Server* server         = connection->server;
+  FILE* input            = fdopen(connection->socket, "r");
+  FILE* output           = fdopen(dup(connection->socket), "w");
+  Byte* buffer           = (Byte*)malloc(SERVER_BLOCK);
+  char line[SERVER_LINE];
+
+  free(connection);
+
+  while (input && output && fgets(line, sizeof(line), input))
   {
-    file_read(archive->files[i], backend);
+    char* fields[5];
+    char* field;
+    char* state;
+    Count count = 0;
+
+    line[strcspn(line, "\r\n")] = '\0';
+
+    for (field = strtok_r(line, "\t", &state); field && count < 5; field = strtok_r(NULL, "\t", &state))
+    {
+      fields[count++] = field;
+    }
+
+    if (count >= 3 && strcmp(fields[0], "GET") == 0)
+    {
+      server_serve(server, output, buffer, fields[1], fields[2],
+                   count > 3 ? strtoull(fields[3], NULL, 10) : 0,
+                   count > 4 ? strtoull(fields[4], NULL, 10) : INDEX_NONE);
+    }
+    else if (count == 1 && strcmp(fields[0], "STATS") == 0)
+    {
+      pthread_mutex_lock(&server->lock);
+      fprintf(output, "OK %zu hits %zu misses %zu cached %zu limit\n", server->hits, server->misses, server->cache_size, server->cache_limit);
+      pthread_mutex_unlock(&server->lock);
+    }
+    else
+    {
+      fprintf(output, "ERR Unknown request\n");
+    }
+
+    if (fflush(output) != 0) break;
   }
 
-  close(backend);
+  if (input)  fclose(input);
+  if (output) fclose(output);
+
+  free(buffer);
+
+  return NULL;
 }
 
-void archive_delete (Archive* archive)
+int server_run (Server* server, const char* path)
 {
-  Count i;
+  struct sockaddr_un address;
+  int listener;
 
-  #pragma omp parallel for
-  for (i = 0; i < archive->files_count; ++i)
+  if (strlen(path) >= sizeof(address.sun_path))
   {
-    file_delete(archive->files[i]);
+    fprintf(stderr, "Socket path `%s` is too long\n", path);
+
+    return -1;
   }
 
-  free(archive->files);
-  free(archive->name);
-  free(archive);
-}
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  unlink(path);
+
+  if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+  {
+    perror("bnc");
+
+    if (listener >= 0) close(listener);
+
+    return -1;
+  }
+
+  /**
+   * Clients going away must not take the server with them
+   */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;)
+  {
+    pthread_t thread;
+    Connection* connection;
+    int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
 
-const char* help = "./bnc [bu] archive file1 file2 ...";
+    if (client < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+
+      break;
+    }
+
+    connection = (Connection*)malloc(sizeof(Connection));
+
+    connection->server = server;
+    connection->socket = client;
+
+    if (pthread_create(&thread, NULL, server_connection, connection) != 0)
+    {
+      close(client);
+      free(connection);
+
+      continue;
+    }
+
+    pthread_detach(thread);
+  }
+
+  perror("bnc");
+  close(listener);
+  unlink(path);
 
-int main (int argc, char** argv)
+  return -1;
+}
+
+void server_delete (Server* server)
 {
-  char op;
-  Archive* archive;
-  int i;
+  while (server->oldest)
+  {
+    server_remove(server, server->oldest);
+  }
 
-  if (argc < 3)
+  while (server->archives)
   {
-    printf("%s\n", help);
+    ServedArchive* archive = server->archives;
 
-    return EXIT_FAILURE;
+    server->archives = archive->next;
+
+    server_drop(server, archive);
   }
 
-  op = argv[1][0];
+  pthread_mutex_destroy(&server->lock);
 
-  archive = archive_new(argv[2]);
+  free(server->buckets);
+  free(server);
+}
 
-  argc -= 3;
-  argv += 3;
+/**
+ * Client side, the archive is resolved here since the server may run in another directory
+ */
+int server_fetch (const char* path, const char* archive, const char* member, Count offset, Count length, FILE* output)
+{
+  struct sockaddr_un address;
+  char line[SERVER_LINE];
+  char* name = realpath(archive, NULL);
+  char* buffer;
+  int client;
+  FILE* input;
+  Count size;
+  int status = -1;
 
-  for (i = 0; i < argc; ++i)
+  if (name == NULL || strlen(path) >= sizeof(address.sun_path))
   {
-    archive_add_file(archive, argv[i]);
+    fprintf(stderr, "Archive `%s` or socket `%s` not usable\n", archive, path);
+    free(name);
+
+    return -1;
   }
 
-  switch (op)
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (client < 0 || connect(client, (struct sockaddr*)&address, sizeof(address)) != 0)
   {
-    case 'b': archive_compress(archive);   break;
-    case 'u': archive_decompress(archive); break;
+    perror("bnc");
+
+    if (client >= 0) close(client);
+    free(name);
+
+    return -1;
   }
 
-  archive_delete(archive);
+  snprintf(line, sizeof(line), "GET\t%s\t%s\t%zu\t%zu\n", name, member, offset, length);
+  free(name);
+
+  input = fdopen(client, "r");
+
+  write_all(client, line, strlen(line));
+
+  if (fgets(line, sizeof(line), input))
+  {
+    if (sscanf(line, "OK %zu", &size) == 1)
+    {
+      buffer = (char*)malloc(COPY_SIZE);
+
+      while (size > 0)
+      {
+        Count count = fread(buffer, 1, size < COPY_SIZE ? size : COPY_SIZE, input);
+
+        if (count == 0) break;
+
+        fwrite(buffer, 1, count, output);
+        size -= count;
+      }
+
+      free(buffer);
+
+      status = size == 0 ? 0 : -1;
+    }
+    else
+    {
+      fprintf(stderr, "%s", strncmp(line, "ERR ", 4) == 0 ? line + 4 : line);
+    }
+  }
+
+  fclose(input);
 
-  return EXIT_SUCCESS;
+  return status;
 }
@@ -1,6 +1,8 @@
 #ifndef __BNC_H__
 #define __BNC_H__
 
+#include <pthread.h>
+
 #define WORDS (1 << (sizeof(Value) * 8))
 
 typedef unsigned char Value;
@@ -92,22 +94,145 @@ void       bit_vector_pop         (BitVector* vector);
 void       bit_vector_set_context (BitVector* vector, Byte left, Byte right);
 void       bit_vector_delete      (BitVector* vector);
 
+typedef struct Budget Budget;
+
+/**
+ * Bounds the windows, stdio buffers, filter frames and trees of the member streams in flight, and what members
+ * keep between their passes, which may take up to half of it. Streams wait for room, members that can not be
+ * kept are streamed one at a time at the end. Only the spares of the threads are left out
+ */
+struct Budget
+{
+  Count limit;
+  Count window;
+  Count buffer;
+  Count streams;
+
+  Count in_flight;
+  Count peak_in_flight;
+  Count kept;
+  Count streamed;
+  Count usage;
+  Count peak_usage;
+};
+
+Budget* budget_new     (const Count limit);
+void    budget_plan    (Budget* budget, const Count members, const Count extra);
+void    budget_acquire (Budget* budget, const Count cost);
+void    budget_release (Budget* budget, const Count cost);
+int     budget_keep    (Budget* budget, const Count size);
+void    budget_drop    (Budget* budget, const Count size);
+void    budget_report  (Budget* budget);
+void    budget_delete  (Budget* budget);
+
+typedef enum
+{
+  STAGE_HISTOGRAM = 0,
+  STAGE_BUILD,
+  STAGE_ENCODE,
+  STAGE_DECODE,
+  STAGE_COUNT
+} Stage;
+
+typedef enum
+{
+  STATS_OFF = 0,
+  STATS_HUMAN,
+  STATS_JSON
+} StatsFormat;
+
+typedef struct Stats   Stats;
+typedef struct Probe   Probe;
+typedef struct Profile Profile;
+
+struct Stats
+{
+  double seconds[STAGE_COUNT];
+  Count  bytes[STAGE_COUNT];
+
+  Count bits;
+  Count remaps;
+  Count minor_faults;
+  Count major_faults;
+};
+
+struct Probe
+{
+  double start;
+  Count  minor_faults;
+  Count  major_faults;
+};
+
+struct Profile
+{
+  StatsFormat format;
+  Stats       total;
+
+  double  wall;
+  double* busy;
+  Count   threads;
+};
+
+Stats*   stats_new      (void);
+void     stats_start    (Stats* stats, Probe* probe);
+void     stats_stop     (Stats* stats, Probe* probe, const Stage stage, const Count bytes);
+void     stats_merge    (Stats* total, Stats* stats);
+void     stats_delete   (Stats* stats);
+double   stats_clock    (void);
+
+Profile* profile_new     (const StatsFormat format);
+void     profile_account (Profile* profile, const double seconds);
+void     profile_delete  (Profile* profile);
+
 typedef struct BitStream BitStream;
 
+/**
+ * Only the first `end` bytes of a window lie within the backend, the rest of the mapping can not be touched.
+ * Appended bits wait in `pending` until they make a whole word, `count` stays at the byte they start in
+ */
 struct BitStream
 {
   Byte* memory_block;
   Count count;
   Count offset;
+  Count window;
+  Count end;
+  Count remaps;
+  Count pending;
+  Count pending_count;
   int backend;
   int protocol;
+  int failed;
 };
 
-BitStream* bit_stream_new    (int backend, int protocol, Count offset);
+BitStream* bit_stream_new        (int backend, int protocol, Count offset, Count window);
+BitStream* bit_stream_new_memory (Byte* memory, int protocol, Count size);
 void       bit_stream_write  (BitStream* stream, BitVector* vector);
+void       bit_stream_write_bits (BitStream* stream, Count bits, Count length);
 void       bit_stream_read   (BitStream* stream, Bit* bit);
 void       bit_stream_delete (BitStream* stream);
 
+#define DECODE_BITS    12
+#define DECODE_SYMBOLS 4
+
+/**
+ * Codes up to CODE_BITS long are also kept as integers, pairs of them fit into one append
+ */
+#define CODE_BITS      28
+#define PAIR_THRESHOLD ((Count)1 << 18)
+
+typedef struct DecodeEntry DecodeEntry;
+
+/**
+ * Everything that DECODE_BITS bits starting at the cursor decode to, at most DECODE_SYMBOLS whole values
+ */
+struct DecodeEntry
+{
+  Value values[DECODE_SYMBOLS];
+  Byte  count;
+  Byte  bits;
+};
+
 typedef struct Tree Tree;
 
 struct Tree
@@ -121,53 +246,450 @@ struct Tree
   Count bit_count;
   Node* table[WORDS];
 
+  Count codes[WORDS];
+  Count lengths[WORDS];
+  Count longest;
+  Count* pair_table;
+
   BitStream* stream;
+
+  DecodeEntry* decode_table;
+  int          decode_ready;
+
+  /**
+   * Nodes of the previous tree, taken again by the next one instead of being allocated
+   */
+  Node* spare_leaves[WORDS];
+  Count spare_leaves_count;
+  Node* spare_inners[WORDS];
+  Count spare_inners_count;
 };
 
 Tree* tree_new              (void);
+void  tree_reset            (Tree* tree);
 void  tree_empty            (Tree* tree);
 void  tree_register         (Tree* tree, const Value value);
+void  tree_register_many    (Tree* tree, const Value value, const Count count);
 void  tree_build            (Tree* tree);
 void  tree_set_write_stream (Tree* tree, BitStream* stream);
 void  tree_set_read_stream  (Tree* tree, BitStream* stream);
+void  tree_build_pair_table (Tree* tree);
+void  tree_drop_pair_table  (Tree* tree);
 void  tree_write            (Tree* tree, const Value value);
+Count tree_write_many       (Tree* tree, const Value* values, Count count);
 void  tree_read             (Tree* tree, Value* value);
+void  tree_read_many        (Tree* tree, Value* values, Count count);
 void  tree_delete           (Tree* tree);
 
+/**
+ * Reversible filters over frames of FILTER_FRAME bytes of the data of a member, applied before counting and
+ * coding. A filter is a mode and an element width in bytes, delta and xor against the previous element are
+ * followed by transposing the bytes of the elements into one plane per byte, like shuffle alone
+ */
+typedef enum
+{
+  FILTER_NONE    = 0,
+  FILTER_SHUFFLE = 1,
+  FILTER_DELTA   = 2,
+  FILTER_XOR     = 3
+} FilterMode;
+
+#define FILTER(mode, width)  ((Count)(mode) | (Count)(width) << 8)
+#define FILTER_MODE(filter)  ((filter) & 0xFF)
+#define FILTER_WIDTH(filter) ((filter) >> 8)
+#define FILTER_AUTO          ((Count)-2)
+#define FILTER_ERROR         ((Count)-1)
+#define FILTER_FRAME         ((Count)1 << 20)
+
+Count       filter_parse  (const char* name);
+const char* filter_name   (Count filter, char* name, Count size);
+void        filter_apply  (Count filter, Byte* bytes, Byte* scratch, Count length);
+void        filter_revert (Count filter, Byte* bytes, Byte* scratch, Count length);
+
 typedef struct File File;
 
 struct File
 {
-  FILE* backend;
-  char* name;
-  Tree* tree;
+  FILE*   backend;
+  char*   name;
+  Tree*   tree;
+  Budget* budget;
+  Stats*  stats;
 
   Count size;
   Count compressed_size;
   Count offset;
+  Count hash;
+  Count reference;
+  Count sample;
+
+  /**
+   * Length of the leading path left out of the name stored in the index
+   */
+  Count base;
+
+  /**
+   * Volume holding the encoded data, zero being the archive itself
+   */
+  Count volume;
+
+  /**
+   * Zero runs left out of the stream as (offset, length) pairs, and the read cursor skipping them
+   */
+  Count* holes;
+  Count  holes_count;
+  Count  data_size;
+  Count  cursor;
+  Count  hole;
+
+  /**
+   * With a block size, every run of similar blocks gets its own tree and starts on a byte boundary. Blocks are
+   * (data length, offset within the member) pairs, the histograms are only kept between reading and writing
+   */
+  Count  block_size;
+  Count* blocks;
+  Count  blocks_count;
+  Count* histograms;
+  Count* block;
+  Count  registered;
+
+  /**
+   * Filter the data is coded through, FILTER_AUTO picks one by trial
+   */
+  Count filter;
+
+  /**
+   * CODER_RAW members are stored as they are, the planner goal decides between that and the ways of coding
+   */
+  Count mode;
+  Count plan;
+
+  /**
+   * Budget charged for what the member keeps from scanning to writing
+   */
+  Count kept;
 };
 
-File* file_new        (const char* name);
-void  file_open_read  (File* file);
+File* file_new        (const char* name, Budget* budget);
+int   file_open_read  (File* file);
 void  file_open_write (File* file);
 void  file_read       (File* file, int backend);
-void  file_write      (File* file, int backend);
+int   file_write      (File* file, int backend);
+void  file_close      (File* file);
 void  file_delete     (File* file);
 
+#define CODER_ERROR  ((Count)-1)
+#define CODER_HEADER (1 + sizeof(Count))
+#define CODER_BLOCK  ((Count)1 << 20)
+
+typedef enum
+{
+  CODER_RAW     = 0,
+  CODER_HUFFMAN = 1
+} CoderMode;
+
+typedef Count (*CoderRead)  (void* user, Byte* buffer, Count size);
+typedef int   (*CoderWrite) (void* user, const Byte* buffer, Count size);
+
+typedef struct Coder Coder;
+
+/**
+ * Reusable per-thread context for in-memory coding, buffers are kept and grown between calls
+ */
+struct Coder
+{
+  Tree* tree;
+
+  Byte* input;
+  Count input_size;
+  Byte* output;
+  Count output_size;
+};
+
+Coder* coder_new           (void);
+Count  coder_bound         (const Count size);
+Count  coder_decoded_size  (const Byte* source, const Count size);
+Count  coder_encode        (Coder* coder, const Byte* source, const Count size, Byte* destination, const Count capacity);
+Count  coder_decode        (Coder* coder, const Byte* source, const Count size, Byte* destination, const Count capacity);
+int    coder_encode_stream (Coder* coder, CoderRead read, CoderWrite write, void* user);
+int    coder_decode_stream (Coder* coder, CoderRead read, CoderWrite write, void* user);
+void   coder_delete        (Coder* coder);
+
+#define INDEX_MAGIC   "BNCINDEX"
+#define INDEX_VERSION 7
+#define INDEX_NONE    ((Count)-1)
+
+typedef struct IndexHeader IndexHeader;
+typedef struct IndexEntry  IndexEntry;
+typedef struct Index       Index;
+
+/**
+ * On-disk layout, all fields in network byte order:
+ *   IndexHeader, IndexEntry[count], Count buckets[buckets], Count holes[2 * holes], Count blocks[2 * blocks],
+ *   Count volumes[2 * volumes], char strings[strings], Count length
+ * Volumes are (name, name length) pairs for the volumes after the archive itself, relative names are
+ * relative to the directory of the archive
+ */
+struct IndexHeader
+{
+  char  magic[8];
+  Count version;
+  Count count;
+  Count buckets;
+  Count holes;
+  Count blocks;
+  Count volumes;
+  Count strings;
+};
+
+struct IndexEntry
+{
+  Count name;
+  Count name_length;
+  Count size;
+  Count compressed_size;
+  Count offset;
+  Count reference;
+  Count holes;
+  Count holes_count;
+  Count blocks;
+  Count blocks_count;
+  Count volume;
+  Count filter;
+  Count mode;
+};
+
+/**
+ * Opening only checks that the sections fit, entries, names and volumes are checked as they are looked up.
+ * Entries are also checked against the sizes known for the archive and its volumes
+ */
+struct Index
+{
+  Byte* memory_block;
+  Count length;
+  Count skip;
+
+  Count count;
+  Count buckets_count;
+  Count holes_count;
+  Count blocks_count;
+  Count volumes_count;
+  Count strings_count;
+
+  /**
+   * Where member data ends in the archive and in each of its volumes, INDEX_NONE while a volume is not open
+   */
+  Count* sizes;
+
+  IndexEntry* entries;
+  Count*      buckets;
+  Count*      holes;
+  Count*      blocks;
+  Count*      volumes;
+  char*       strings;
+};
+
+Index*      index_open          (int backend);
+Count       index_find          (Index* index, const char* name);
+const char* index_name          (Index* index, Count position);
+const char* index_volume        (Index* index, Count volume);
+int         index_entry         (Index* index, Count position, IndexEntry* entry);
+void        index_holes         (Index* index, IndexEntry* entry, Count* holes);
+void        index_blocks        (Index* index, IndexEntry* entry, Count* blocks);
+void        index_bound_volumes (Index* index, const int* backends);
+void        index_close         (Index* index);
+
+/**
+ * Planner goals, otherwise the rate in MB/s that every member has to be coded at on one thread
+ */
+#define PLAN_OFF   ((Count)0)
+#define PLAN_RATIO ((Count)-1)
+
 typedef struct Archive Archive;
 
 struct Archive
 {
-  char* name;
+  char*    name;
+  Budget*  budget;
+  Profile* profile;
 
   File** files;
   Count  files_count;
+  Count  files_capacity;
+
+  /**
+   * Walked while compressing, the members found are appended to files
+   */
+  char** directories;
+  Count  directories_count;
+
+  /**
+   * With targets or a volume limit the members go into volumes of their own and the archive only keeps the index.
+   * Members are striped over the targets, a target starts a new volume when the next member would pass the limit
+   */
+  char** targets;
+  Count  targets_count;
+  Count  volume_limit;
+  char** volumes;
+  Count  volumes_count;
+
+  Count sample;
+  Count block_size;
+  Count filter;
+  Count plan;
+};
+
+Archive* archive_new           (const char* name, Budget* budget);
+File*    archive_add_file      (Archive* archive, const char* file);
+void     archive_add_directory (Archive* archive, const char* directory);
+void     archive_add_target    (Archive* archive, const char* target);
+void     archive_compress      (Archive* archive);
+int      archive_decompress    (Archive* archive);
+int      archive_list          (Archive* archive);
+void     archive_delete        (Archive* archive);
+
+typedef struct Job   Job;
+typedef struct Batch Batch;
+
+/**
+ * Manifests list one job per line, fields separated by tabs:
+ *   b archive path...
+ *   u archive [member...]
+ *   l archive
+ * Blank lines and lines starting with # are skipped
+ */
+struct Job
+{
+  char   op;
+  char*  archive;
+  char** paths;
+  Count  paths_count;
+  Count  line;
+  Count  key;
+
+  int    status;
+  Count  members;
+  Count  size;
+  Count  compressed_size;
+  double seconds;
+};
+
+/**
+ * Jobs run as tasks of one worker pool, each job on a single worker within that worker's share of the
+ * limit. Jobs on the same archive, however it is spelled, run in manifest order. The files they read or
+ * extract are not ordered, jobs writing the same paths race. The options apply to every archive
+ */
+struct Batch
+{
+  Profile* profile;
+
+  Job*  jobs;
+  Count jobs_count;
+
+  Count  limit;
+  Count  sample;
+  Count  block_size;
+  Count  filter;
+  Count  plan;
+  Count  volume_limit;
+  char** targets;
+  Count  targets_count;
+};
+
+Batch* batch_new      (const Count limit, const StatsFormat format);
+int    batch_read     (Batch* batch, FILE* manifest);
+int    batch_run      (Batch* batch);
+void   batch_report   (Batch* batch);
+void   batch_delete   (Batch* batch);
+void   spares_release (void);
+
+/**
+ * The data of members is decoded in blocks of this size, one filter frame each, and holes are filled in when serving.
+ * The cache holds SERVER_CACHE bytes unless a budget is given
+ */
+#define SERVER_BLOCK FILTER_FRAME
+#define SERVER_CACHE ((Count)256 << 20)
+
+typedef struct ServedMember  ServedMember;
+typedef struct ServedArchive ServedArchive;
+typedef struct CachedBlock   CachedBlock;
+typedef struct Server        Server;
+
+/**
+ * The tree stays loaded, and the stream position at the start of every block decoded so far is kept
+ * so that later blocks resume there instead of at the start of the member
+ */
+struct ServedMember
+{
+  pthread_mutex_t lock;
+
+  Tree*  tree;
+  Count  loaded;
+  Count  volume;
+  Count  offset;
+  Count  size;
+  Count  data_size;
+  Count  filter;
+  Count  mode;
+  Count* holes;
+  Count  holes_count;
+  Count* blocks;
+  Count  blocks_count;
+  Count* checkpoints;
+  Count  checkpoints_count;
+};
+
+/**
+ * The identity of the archive when it was opened, a rewritten archive is opened again once its last
+ * user is done with it
+ */
+struct ServedArchive
+{
+  char*  name;
+  int*   backends;
+  Index* index;
+  Count  inode;
+  Count  size;
+  Count  modified;
+  Count  users;
+  int    stale;
+
+  ServedMember*  members;
+  ServedArchive* next;
+};
+
+struct CachedBlock
+{
+  ServedMember* member;
+  Count         block;
+  Byte*         bytes;
+  Count         size;
+
+  CachedBlock* newer;
+  CachedBlock* older;
+  CachedBlock* chained;
+};
+
+struct Server
+{
+  pthread_mutex_t lock;
+
+  Budget*        budget;
+  ServedArchive* archives;
+
+  CachedBlock** buckets;
+  CachedBlock*  newest;
+  CachedBlock*  oldest;
+
+  Count cache_size;
+  Count cache_limit;
+  Count hits;
+  Count misses;
 };
 
-Archive* archive_new        (const char* name);
-void     archive_add_file   (Archive* archive, const char* file);
-void     archive_compress   (Archive* archive);
-void     archive_decompress (Archive* archive);
-void     archive_delete     (Archive* archive);
+Server* server_new    (Budget* budget, Count cache_limit);
+int     server_run    (Server* server, const char* path);
+void    server_delete (Server* server);
+int     server_fetch  (const char* path, const char* archive, const char* member, Count offset, Count length, FILE* output);
 
 #endif /* __BNC_H__ */
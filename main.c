@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <bnc.h>
+
+/**
+ * Sizes are a whole number of bytes with an optional K, M or G suffix, anything else or an overflow fails
+ */
+static int parse_size (const char* text, Count* size)
+{
+  char* end;
+  int shift = 0;
+
+  errno = 0;
+  *size = strtoull(text, &end, 10);
+
+  if (errno != 0 || end == text || *text == '-') return -1;
+
+  switch (*end)
+  {
+    case 'k': case 'K': shift = 10; ++end; break;
+    case 'm': case 'M': shift = 20; ++end; break;
+    case 'g': case 'G': shift = 30; ++end; break;
+  }
+
+  if (*end != '\0' || *size > (Count)-1 >> shift) return -1;
+
+  *size <<= shift;
+
+  return 0;
+}
+
+const char* help = "./bnc [-M budget] [-s sample] [-B block] [-V target]... [-L volume] [-F filter] [-P rate|ratio] [-S|--stats[=json]] [bul] archive path1 path2 ...\n"
+                   "./bnc [-M total] ... [-S|--stats[=json]] j manifest|-\n"
+                   "./bnc [-M cache] d socket\n"
+                   "./bnc g socket archive member [offset [length]]";
+
+static struct option options[] =
+{
+  { "budget", required_argument, NULL, 'M' },
+  { "sample", required_argument, NULL, 's' },
+  { "blocks", required_argument, NULL, 'B' },
+  { "target", required_argument, NULL, 'V' },
+  { "volume", required_argument, NULL, 'L' },
+  { "filter", required_argument, NULL, 'F' },
+  { "plan",   required_argument, NULL, 'P' },
+  { "stats",  optional_argument, NULL, 'S' },
+  { NULL,     0,                 NULL, 0   }
+};
+
+int main (int argc, char** argv)
+{
+  char op;
+  Archive* archive;
+  Budget* budget;
+  int i;
+  int option;
+  int status = 0;
+  Count limit  = 0;
+  Count sample = 0;
+  Count blocks = 0;
+  Count volume = 0;
+  Count* size;
+  Count filter = FILTER_NONE;
+  Count plan   = PLAN_OFF;
+  char** targets = NULL;
+  int targets_count = 0;
+  StatsFormat format = STATS_OFF;
+
+  while ((option = getopt_long(argc, argv, "+M:s:B:V:L:F:P:S", options, NULL)) != -1)
+  {
+    switch (option)
+    {
+      case 'M':
+      case 'B':
+      case 'L':
+        size = option == 'M' ? &limit : option == 'B' ? &blocks : &volume;
+
+        /**
+         * No budget is a budget of zero, blocks and volumes of zero bytes are meaningless
+         */
+        if (parse_size(optarg, size) != 0 || (*size == 0 && option != 'M'))
+        {
+          fprintf(stderr, "Invalid size `%s` for -%c, expected a %snumber of bytes with an optional K, M or G suffix\n",
+                  optarg, option, option == 'M' ? "" : "positive ");
+
+          return EXIT_FAILURE;
+        }
+        break;
+      case 's': sample = strtoull(optarg, NULL, 10); break;
+      case 'F':
+        filter = filter_parse(optarg);
+
+        if (filter == FILTER_ERROR)
+        {
+          fprintf(stderr, "Unknown filter `%s`, expected none, auto, or shuffle, delta or xor followed by an element width of 1, 2, 4 or 8\n", optarg);
+
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'P':
+        plan = strcmp(optarg, "ratio") == 0 ? PLAN_RATIO : strtoull(optarg, NULL, 10);
+
+        if (plan == PLAN_OFF)
+        {
+          fprintf(stderr, "Unknown plan `%s`, expected a rate in MB/s or ratio\n", optarg);
+
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'V':
+        targets = (char**)realloc(targets, (targets_count + 1) * sizeof(char*));
+        targets[targets_count++] = optarg;
+        break;
+      case 'S': format = optarg && strcmp(optarg, "json") == 0 ? STATS_JSON : STATS_HUMAN; break;
+      default:
+        printf("%s\n", help);
+
+        return EXIT_FAILURE;
+    }
+  }
+
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc < 3)
+  {
+    printf("%s\n", help);
+
+    return EXIT_FAILURE;
+  }
+
+  op = argv[1][0];
+
+  /**
+   * The workers split the budget between them, the options apply to all of the archives
+   */
+  if (op == 'j')
+  {
+    Batch* batch   = batch_new(limit, format);
+    FILE* manifest = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+
+    batch->sample        = sample;
+    batch->block_size    = blocks;
+    batch->filter        = filter;
+    batch->plan          = plan;
+    batch->volume_limit  = volume;
+    batch->targets       = targets;
+    batch->targets_count = targets_count;
+
+    if (manifest == NULL)
+    {
+      perror(argv[2]);
+
+      status = -1;
+    }
+    else if ((status = batch_read(batch, manifest)) == 0)
+    {
+      status = batch_run(batch);
+
+      batch_report(batch);
+    }
+
+    if (manifest && manifest != stdin) fclose(manifest);
+
+    batch_delete(batch);
+    free(targets);
+
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  budget = budget_new(limit);
+
+  /**
+   * Serving keeps decoded blocks in memory, the budget bounds the cache instead of the streams
+   */
+  if (op == 'd')
+  {
+    Server* server = server_new(budget, limit > 0 ? limit : SERVER_CACHE);
+
+    status = server_run(server, argv[2]);
+
+    server_delete(server);
+    budget_delete(budget);
+
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (op == 'g')
+  {
+    if (argc < 5)
+    {
+      printf("%s\n", help);
+      budget_delete(budget);
+
+      return EXIT_FAILURE;
+    }
+
+    status = server_fetch(argv[2], argv[3], argv[4],
+                          argc > 5 ? strtoull(argv[5], NULL, 10) : 0,
+                          argc > 6 ? strtoull(argv[6], NULL, 10) : INDEX_NONE, stdout);
+
+    budget_delete(budget);
+
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  archive = archive_new(argv[2], budget);
+
+  archive->sample       = sample;
+  archive->block_size   = blocks;
+  archive->volume_limit = volume;
+  archive->filter       = filter;
+  archive->plan         = plan;
+
+  for (i = 0; i < targets_count; ++i)
+  {
+    archive_add_target(archive, targets[i]);
+  }
+
+  free(targets);
+
+  if (format != STATS_OFF)
+  {
+    archive->profile = profile_new(format);
+  }
+
+  argc -= 3;
+  argv += 3;
+
+  for (i = 0; i < argc; ++i)
+  {
+    struct stat status;
+
+    /**
+     * Directories are archived recursively, their members keep paths relative to the directory's parent
+     */
+    if (op == 'b' && stat(argv[i], &status) == 0 && S_ISDIR(status.st_mode))
+    {
+      archive_add_directory(archive, argv[i]);
+
+      continue;
+    }
+
+    archive_add_file(archive, argv[i]);
+  }
+
+  switch (op)
+  {
+    case 'b':          archive_compress(archive);   break;
+    case 'u': status = archive_decompress(archive); break;
+    case 'l': status = archive_list(archive);       break;
+  }
+
+  if (budget->limit > 0)
+  {
+    budget_report(budget);
+  }
+
+  if (archive->profile)
+  {
+    profile_delete(archive->profile);
+  }
+
+  archive_delete(archive);
+  budget_delete(budget);
+  spares_release();
+
+  return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}